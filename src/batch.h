@@ -0,0 +1,478 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "interpreter.h"
+#include "memstats.h"
+#include "stack.h"
+
+// Lock-step batch execution: one compiled routine runs over many independent
+// data stacks at once. Values are stored by row, one row per stack depth
+// holding the value of every lane in a plain array, so each token is a single
+// loop over the whole batch. A row has one type for all its lanes (int, float
+// or bool). Only tokens without side effects run in lock-step: on the first
+// token that prints, calls, touches a global, needs a string or would send
+// lanes down different paths, every lane gets its values back as a Stack and
+// continues alone from that token. Results are the same as executing the
+// stacks one after the other
+
+#define BATCH_DEFAULT_LANES 256
+
+typedef struct {
+    ValueType type;     // VT_UNKNOWN for a local not assigned yet
+    long *ints;         // VT_INT and VT_BOOL
+    double *reals;      // VT_FLOAT
+} BatchRow;
+
+typedef struct {
+    size_t lanes;
+
+    // data stack, rows[count-1] is the top. Rows above count keep their
+    // arrays to be reused by the next push
+    BatchRow *rows;
+    size_t count;
+    size_t capacity;
+
+    // parameters and locals of the routine
+    BatchRow *slots;
+    size_t slot_count;
+
+    // results are computed here and swapped in when the whole batch agrees
+    BatchRow scratch;
+} Batch;
+
+void batch_row_init(BatchRow *row, size_t lanes)
+{
+    row->type = VT_UNKNOWN;
+    row->ints = mem_alloc(MEM_STACK, lanes*sizeof(*row->ints));
+    row->reals = mem_alloc(MEM_STACK, lanes*sizeof(*row->reals));
+}
+
+void batch_row_copy(BatchRow *dst, BatchRow *src, size_t lanes)
+{
+    dst->type = src->type;
+    if (src->type == VT_FLOAT) memcpy(dst->reals, src->reals, lanes*sizeof(*dst->reals));
+    else memcpy(dst->ints, src->ints, lanes*sizeof(*dst->ints));
+}
+
+void batch_row_swap(BatchRow *a, BatchRow *b)
+{
+    BatchRow tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+Value *batch_row_value(BatchRow *row, size_t k)
+{
+    switch (row->type) {
+        case VT_INT: return value_create_int(row->ints[k]);
+        case VT_FLOAT: return value_create_float(row->reals[k]);
+        case VT_BOOL: return value_create_bool(row->ints[k] != 0);
+        default: return NULL;
+    }
+}
+
+BatchRow *batch_push(Batch *batch)
+{
+    if (batch->count == batch->capacity) {
+        size_t capacity = batch->capacity == 0 ? 16 : (batch->capacity*2);
+        batch->rows = mem_realloc(MEM_STACK, batch->rows, capacity*sizeof(*batch->rows));
+        for (size_t d = batch->capacity; d < capacity; ++d) batch_row_init(&batch->rows[d], batch->lanes);
+        batch->capacity = capacity;
+    }
+
+    return &batch->rows[batch->count++];
+}
+
+BatchRow *batch_peek(Batch *batch, size_t n)
+{
+    return &batch->rows[batch->count-1-n];
+}
+
+bool batch_load(Batch *batch, Routine *routine, Stack **stacks)
+{
+    // move the stacks into rows, every lane must have the same depth and the
+    // same type at each depth
+    size_t depth = stacks[0]->count;
+    for (size_t k = 1; k < batch->lanes; ++k) {
+        if (stacks[k]->count != depth) return false;
+    }
+
+    for (size_t d = 0; d < depth; ++d) {
+        ValueType type = stacks[0]->items[d]->type;
+        if (type != VT_INT && type != VT_FLOAT && type != VT_BOOL) return false;
+
+        for (size_t k = 1; k < batch->lanes; ++k) {
+            if (stacks[k]->items[d]->type != type) return false;
+        }
+    }
+
+    if (depth < routine->param_count) return false;
+
+    for (size_t d = 0; d < depth; ++d) {
+        BatchRow *row = batch_push(batch);
+        row->type = stacks[0]->items[d]->type;
+
+        for (size_t k = 0; k < batch->lanes; ++k) {
+            Value *value = stacks[k]->items[d];
+            if (row->type == VT_FLOAT) row->reals[k] = value->real;
+            else if (row->type == VT_INT) row->ints[k] = value->integer;
+            else row->ints[k] = value->boolean;
+        }
+    }
+
+    for (size_t k = 0; k < batch->lanes; ++k) {
+        while (stacks[k]->count > 0) st_pop(stacks[k]);
+    }
+
+    // arguments go from the top rows to the parameter slots, like frames_enter
+    batch->slot_count = routine->slot_count;
+    batch->slots = mem_alloc(MEM_STACK, (routine->slot_count+1)*sizeof(*batch->slots));
+    for (size_t s = 0; s < routine->slot_count; ++s) batch_row_init(&batch->slots[s], batch->lanes);
+
+    batch->count -= routine->param_count;
+    for (size_t s = 0; s < routine->param_count; ++s)
+        batch_row_swap(&batch->slots[s], &batch->rows[batch->count + s]);
+
+    return true;
+}
+
+void batch_store_lane(Batch *batch, size_t k, Stack *mem)
+{
+    for (size_t d = 0; d < batch->count; ++d)
+        st_push(mem, batch_row_value(&batch->rows[d], k));
+}
+
+void batch_diverge(Batch *batch, Routine *routine, size_t start, Stack **stacks, FrameStack *frames, GScope *gscope)
+{
+    // lanes can't stay together, each one continues from start on its own
+    for (size_t k = 0; k < batch->lanes; ++k) {
+        batch_store_lane(batch, k, stacks[k]);
+
+        size_t base = frames->count;
+        frames_reserve(frames, batch->slot_count);
+        for (size_t s = 0; s < batch->slot_count; ++s)
+            frames->slots[base + s] = batch_row_value(&batch->slots[s], k);
+        frames->count += batch->slot_count;
+
+        rte_run(routine, start, base, stacks[k], frames, gscope);
+        frames_leave(frames, base);
+    }
+}
+
+bool batch_arithmetic(Batch *batch, TokenType op)
+{
+    // "a b op" for every lane into scratch, false when lanes would disagree
+    // on the result type or any of them would fail
+    const size_t lanes = batch->lanes;
+    BatchRow *a = batch_peek(batch, 1);
+    BatchRow *b = batch_peek(batch, 0);
+    BatchRow *r = &batch->scratch;
+
+    if ((a->type != VT_INT && a->type != VT_FLOAT) || (b->type != VT_INT && b->type != VT_FLOAT)) return false;
+
+    if (op == OP_DIV || op == OP_MOD) {
+        for (size_t k = 0; k < lanes; ++k) {
+            if (b->type == VT_INT ? b->ints[k] == 0 : b->reals[k] == 0) return false;
+
+            // LONG_MIN / -1 traps, the lanes go through rte_arithmetic instead
+            if (a->type == VT_INT && b->type == VT_INT && b->ints[k] == -1 && a->ints[k] == LONG_MIN) return false;
+        }
+    }
+
+    if (a->type == VT_INT && b->type == VT_INT) {
+        const long *x = a->ints;
+        const long *y = b->ints;
+        long *z = r->ints;
+        r->type = VT_INT;
+
+        switch (op) {
+            // any lane that overflows becomes float, so they would disagree
+            case OP_SUM: {
+                bool overflow = false;
+                for (size_t k = 0; k < lanes; ++k) overflow |= __builtin_add_overflow(x[k], y[k], &z[k]);
+                return !overflow;
+            }
+            case OP_SUB: {
+                bool overflow = false;
+                for (size_t k = 0; k < lanes; ++k) overflow |= __builtin_sub_overflow(x[k], y[k], &z[k]);
+                return !overflow;
+            }
+            case OP_MUL: {
+                bool overflow = false;
+                for (size_t k = 0; k < lanes; ++k) overflow |= __builtin_mul_overflow(x[k], y[k], &z[k]);
+                return !overflow;
+            }
+            case OP_MOD: for (size_t k = 0; k < lanes; ++k) z[k] = x[k] % y[k];
+                return true;
+            case OP_DIV: {
+                // exact divisions stay int, the others become float
+                size_t exact = 0;
+                for (size_t k = 0; k < lanes; ++k) exact += x[k] % y[k] == 0;
+
+                if (exact == lanes) {
+                    for (size_t k = 0; k < lanes; ++k) z[k] = x[k] / y[k];
+                } else if (exact == 0) {
+                    r->type = VT_FLOAT;
+                    for (size_t k = 0; k < lanes; ++k) r->reals[k] = (double) x[k] / y[k];
+                } else return false;
+                return true;
+            }
+            default:
+                assert(0 && "Unreachable");
+                return false;
+        }
+    }
+
+    // mixed operands, go through doubles like rte_arithmetic
+    double *z = r->reals;
+    for (size_t k = 0; k < lanes; ++k) {
+        double x = a->type == VT_INT ? (double) a->ints[k] : a->reals[k];
+        double y = b->type == VT_INT ? (double) b->ints[k] : b->reals[k];
+
+        switch (op) {
+            case OP_SUM: z[k] = x + y;
+                break;
+            case OP_SUB: z[k] = x - y;
+                break;
+            case OP_MUL: z[k] = x * y;
+                break;
+            case OP_DIV: z[k] = x / y;
+                break;
+            case OP_MOD: z[k] = fmod(x, y);
+                break;
+            default:
+                assert(0 && "Unreachable");
+                break;
+        }
+    }
+
+    // results that are essentially ints are converted, in all lanes or none
+    size_t integral = 0;
+    double intpart;
+    for (size_t k = 0; k < lanes; ++k) integral += modf(z[k], &intpart) == 0 && fabs(intpart) < 9.2e18;
+
+    if (integral == lanes) {
+        r->type = VT_INT;
+        for (size_t k = 0; k < lanes; ++k) r->ints[k] = (long) z[k];
+    } else if (integral == 0) {
+        r->type = VT_FLOAT;
+    } else return false;
+
+    return true;
+}
+
+bool batch_compare(Batch *batch, TokenType op)
+{
+    const size_t lanes = batch->lanes;
+    BatchRow *a = batch_peek(batch, 1);
+    BatchRow *b = batch_peek(batch, 0);
+    BatchRow *r = &batch->scratch;
+    long *z = r->ints;
+
+    bool a_number = a->type == VT_INT || a->type == VT_FLOAT;
+    bool b_number = b->type == VT_INT || b->type == VT_FLOAT;
+    r->type = VT_BOOL;
+
+    if (a->type != b->type && !(a_number && b_number)) {
+        // values of different types are never equal, ordering them fails
+        if (op != OP_EQ && op != OP_NEQ) return false;
+        for (size_t k = 0; k < lanes; ++k) z[k] = op == OP_NEQ;
+        return true;
+    }
+
+    for (size_t k = 0; k < lanes; ++k) {
+        int cmp = 0;
+        if (a->type == VT_FLOAT || b->type == VT_FLOAT) {
+            double x = a->type == VT_INT ? (double) a->ints[k] : a->reals[k];
+            double y = b->type == VT_INT ? (double) b->ints[k] : b->reals[k];
+            cmp = (x > y) - (x < y);
+        } else cmp = (a->ints[k] > b->ints[k]) - (a->ints[k] < b->ints[k]);
+
+        switch (op) {
+            case OP_EQ: z[k] = cmp == 0;
+                break;
+            case OP_NEQ: z[k] = cmp != 0;
+                break;
+            case OP_GT: z[k] = cmp > 0;
+                break;
+            case OP_GTE: z[k] = cmp >= 0;
+                break;
+            case OP_LT: z[k] = cmp < 0;
+                break;
+            case OP_LTE: z[k] = cmp <= 0;
+                break;
+            default:
+                assert(0 && "Unreachable");
+                break;
+        }
+    }
+
+    return true;
+}
+
+void batch_commit_binary(Batch *batch)
+{
+    // replace the two operands with the scratch row
+    batch->count--;
+    batch_row_swap(batch_peek(batch, 0), &batch->scratch);
+}
+
+void batch_destroy(Batch *batch)
+{
+    for (size_t d = 0; d < batch->capacity; ++d) {
+        mem_free(batch->rows[d].ints);
+        mem_free(batch->rows[d].reals);
+    }
+    for (size_t s = 0; s < batch->slot_count; ++s) {
+        mem_free(batch->slots[s].ints);
+        mem_free(batch->slots[s].reals);
+    }
+
+    mem_free(batch->rows);
+    mem_free(batch->slots);
+    mem_free(batch->scratch.ints);
+    mem_free(batch->scratch.reals);
+}
+
+void rte_execute_batch(Routine *routine, Stack **stacks, size_t n, GScope *gscope)
+{
+    // run routine over n data stacks, each one ends up like after
+    // rte_execute(routine, stacks[k], ...)
+    if (n == 0) return;
+    if (routine->state != COMPILE_DONE) rte_compile(gscope, routine);
+
+    FrameStack *frames = frames_create(routine->slot_count);
+    Batch batch = {0};
+    batch.lanes = n;
+    batch_row_init(&batch.scratch, n);
+
+    PROFILE_ENTER(routine->index);
+
+    // the tracer records tokens against a single Stack
+    bool lock_step = !tracer.enabled && batch_load(&batch, routine, stacks);
+    bool diverged = false;
+
+    for (size_t i = 0; lock_step && i < routine->code_count; ++i) {
+        Instr *in = &routine->code[i];
+        bool together = true;
+
+        switch (in->op) {
+            case CONST_LOAD: {
+                Value *value = gscope->constants[in->arg];
+                if (value->type != VT_INT && value->type != VT_FLOAT && value->type != VT_BOOL) {
+                    together = false;
+                    break;
+                }
+
+                BatchRow *row = batch_push(&batch);
+                row->type = value->type;
+                for (size_t k = 0; k < n; ++k) {
+                    if (value->type == VT_FLOAT) row->reals[k] = value->real;
+                    else row->ints[k] = value->type == VT_INT ? value->integer : value->boolean;
+                }
+            } break;
+
+            case OP_SUM:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD: {
+                together = batch.count >= 2 && batch_arithmetic(&batch, in->op);
+                if (together) batch_commit_binary(&batch);
+            } break;
+
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_GT:
+            case OP_GTE:
+            case OP_LT:
+            case OP_LTE: {
+                together = batch.count >= 2 && batch_compare(&batch, in->op);
+                if (together) batch_commit_binary(&batch);
+            } break;
+
+            case KW_DUP: {
+                if (!(together = batch.count >= 1)) break;
+                BatchRow *row = batch_push(&batch);
+                batch_row_copy(row, batch_peek(&batch, 1), n);
+            } break;
+
+            case KW_OVER: {
+                if (!(together = batch.count >= 2)) break;
+                BatchRow *row = batch_push(&batch);
+                batch_row_copy(row, batch_peek(&batch, 2), n);
+            } break;
+
+            case KW_DROP: {
+                if ((together = batch.count >= 1)) batch.count--;
+            } break;
+
+            case KW_SWAP: {
+                if ((together = batch.count >= 2)) batch_row_swap(batch_peek(&batch, 0), batch_peek(&batch, 1));
+            } break;
+
+            case LOCAL_LOAD: {
+                BatchRow *slot = &batch.slots[in->arg];
+                if (!(together = slot->type != VT_UNKNOWN)) break;
+                batch_row_copy(batch_push(&batch), slot, n);
+            } break;
+
+            case LOCAL_STORE: {
+                if (!(together = batch.count >= 1)) break;
+                batch_row_swap(&batch.slots[in->arg], batch_peek(&batch, 0));
+                batch.count--;
+            } break;
+
+            case KW_IF: {
+                if (!(together = batch.count >= 1 && batch_peek(&batch, 0)->type == VT_BOOL)) break;
+
+                // every lane must take the same branch
+                long *cond = batch_peek(&batch, 0)->ints;
+                size_t taken = 0;
+                for (size_t k = 0; k < n; ++k) taken += cond[k] != 0;
+                if (!(together = taken == 0 || taken == n)) break;
+
+                batch.count--;
+                if (taken == 0) i += in->arg;
+            } break;
+
+            case KW_ELSE: i += in->arg;
+                break;
+
+            case KW_THEN:
+            case KW_END: break;
+
+            default: together = false;
+                break;
+        }
+
+        if (!together) {
+            batch_diverge(&batch, routine, i, stacks, frames, gscope);
+            diverged = true;
+            break;
+        }
+    }
+
+    if (!lock_step) {
+        // like rte_execute, the batch was already counted by the profiler
+        for (size_t k = 0; k < n; ++k) {
+            size_t base = frames_enter(frames, routine, stacks[k]);
+            rte_run(routine, 0, base, stacks[k], frames, gscope);
+            frames_leave(frames, base);
+        }
+    } else if (!diverged) {
+        for (size_t k = 0; k < n; ++k) batch_store_lane(&batch, k, stacks[k]);
+    }
+
+    PROFILE_LEAVE();
+    batch_destroy(&batch);
+    frames_destroy(frames);
+}
+
+#endif  // BATCH_H_
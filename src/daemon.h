@@ -0,0 +1,431 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "trap.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "stack.h"
+#include "tasks.h"
+
+// Daemon mode: programs stay compiled between runs and execution requests
+// come from a Unix domain socket, one per connection, served by a pool of
+// worker threads. A request is a single line
+//
+//     PATH ROUTINE [VALUE...]
+//
+// values are pushed in order before ROUTINE runs, like a --batch line. The
+// reply is "ok" or "error" on the first line, then everything the routine
+// printed and the values left on its stack, if any. Errors are reported on
+// the stderr of the daemon
+//
+// Programs are cached by path and reloaded when the hash of the file content
+// changes. Programs that never bind a global run concurrently, their
+// constants are shared between workers. The others run one request at a
+// time and get their globals back to the initial values before each run
+
+#define DAEMON_DEFAULT_WORKERS 4
+#define DAEMON_QUEUE_CAPACITY 64
+#define DAEMON_REQUEST_MAX_SIZE 4096
+#define DAEMON_STACK_CAPACITY 16
+
+typedef struct {
+    char *path;
+    uint64_t hash;
+    GScope *gscope;
+
+    // one for the cache plus one per running request
+    size_t refs;
+
+    // held for the whole run when some global is rebound
+    bool rebound;
+    pthread_mutex_t lock;
+    Value **initial;
+} DaemonProgram;
+
+typedef struct {
+    DaemonProgram **programs;
+    size_t count;
+    size_t capacity;
+    pthread_mutex_t lock;
+} DaemonCache;
+
+// accepted connections waiting for a worker
+typedef struct {
+    int fds[DAEMON_QUEUE_CAPACITY];
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} DaemonQueue;
+
+DaemonCache daemon_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+DaemonQueue daemon_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+uint64_t daemon_hash(const char *buffer, size_t size)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (uint8_t) buffer[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+char *daemon_read_file(const char *path, size_t *size)
+{
+    // NULL when the file can't be read, the daemon keeps serving
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return NULL;
+
+    size_t capacity = 4096;
+    char *buffer = mem_alloc(MEM_LEXER, capacity);
+    *size = 0;
+
+    size_t read_bytes;
+    while ((read_bytes = fread(buffer + *size, 1, capacity - *size - 1, file)) > 0) {
+        *size += read_bytes;
+        if (capacity - *size == 1) {
+            capacity *= 2;
+            buffer = mem_realloc(MEM_LEXER, buffer, capacity);
+        }
+    }
+
+    buffer[*size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+void daemon_program_release(DaemonProgram *program)
+{
+    if (__atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+
+    // nobody else sees the program anymore, constants go back to plain refs
+    GScope *gscope = program->gscope;
+    for (size_t i = 0; i < gscope->const_count; ++i)
+        gscope->constants[i]->shared = false;
+
+    for (size_t j = 0; j < gscope->var_count; ++j)
+        value_unref(program->initial[j]);
+
+    mem_free(program->initial);
+    gscope_destroy(gscope);
+    pthread_mutex_destroy(&program->lock);
+    mem_free(program->path);
+    mem_free(program);
+}
+
+DaemonProgram *daemon_program_compile(const char *path, char *buffer, uint64_t hash)
+{
+    DaemonProgram *program = mem_alloc(MEM_SCOPE, sizeof(DaemonProgram));
+    program->path = mem_strdup(MEM_SCOPE, path);
+    program->hash = hash;
+    program->refs = 1;
+
+    // whatever was built when an error jumps back is released, the gscope
+    // owns the module once scanning started
+    Module *volatile mod = NULL;
+    GScope *volatile gscope = NULL;
+
+    jmp_buf trap;
+    rte_trap = &trap;
+
+    if (setjmp(trap) != 0) {
+        rte_trap = NULL;
+        if (gscope != NULL) {
+            gscope->mod = mod;
+            gscope_destroy(gscope);
+        } else if (mod != NULL) mod_destroy(mod);
+        mem_free(program->path);
+        mem_free(program);
+        return NULL;
+    }
+
+    // any routine may be requested, compile them all now so runs never
+    // modify the program
+    mod = mod_create(program->path, MODULE_INITIAL_CAPACITY);
+    lex_range(mod, buffer, 0, strlen(buffer), 1);
+
+    gscope = gscope_create(GSCOPE_ROUTINES_INITIAL_CAPACITY, GSCOPE_VARIABLES_INITIAL_CAPACITY);
+    scan_modules(gscope, mod);
+    gscope_mark_rebound_variables(gscope);
+    gscope_compile_routines(gscope);
+    tasks_prepare(gscope, 0);
+    rte_trap = NULL;
+
+    program->gscope = gscope;
+    program->rebound = false;
+    program->initial = mem_alloc(MEM_SCOPE, (gscope->var_count+1)*sizeof(*program->initial));
+    for (size_t j = 0; j < gscope->var_count; ++j) {
+        program->rebound |= gscope->variables[j]->rebound;
+        program->initial[j] = value_ref(gscope->variables[j]->value);
+    }
+
+    for (size_t i = 0; i < gscope->const_count; ++i)
+        gscope->constants[i]->shared = true;
+
+    pthread_mutex_init(&program->lock, NULL);
+    return program;
+}
+
+DaemonProgram *daemon_program_acquire(const char *path)
+{
+    // cached program for path, compiled again when the file has changed
+    size_t size = 0;
+    char *buffer = daemon_read_file(path, &size);
+    if (buffer == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not open file: %s\n", ERR_EXP, path);
+        return NULL;
+    }
+
+    uint64_t hash = daemon_hash(buffer, size);
+    DaemonCache *cache = &daemon_cache;
+
+    pthread_mutex_lock(&cache->lock);
+    for (size_t k = 0; k < cache->count; ++k) {
+        DaemonProgram *program = cache->programs[k];
+        if (program->hash == hash && strcmp(program->path, path) == 0) {
+            __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&cache->lock);
+            mem_free(buffer);
+            return program;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    // compiled without holding the cache, two workers may both compile a
+    // new version and the last one stays cached
+    DaemonProgram *program = daemon_program_compile(path, buffer, hash);
+    mem_free(buffer);
+    if (program == NULL) return NULL;
+
+    __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&cache->lock);
+    DaemonProgram *old = NULL;
+    size_t k = 0;
+    while (k < cache->count && strcmp(cache->programs[k]->path, path) != 0) k++;
+
+    if (k == cache->count) {
+        if (cache->count == cache->capacity) {
+            cache->capacity = cache->capacity == 0 ? 16 : (cache->capacity*2);
+            cache->programs = mem_realloc(MEM_SCOPE, cache->programs, cache->capacity*sizeof(*cache->programs));
+        }
+        cache->count++;
+    } else old = cache->programs[k];
+
+    cache->programs[k] = program;
+    pthread_mutex_unlock(&cache->lock);
+
+    // requests still running the old version keep it alive
+    if (old != NULL) daemon_program_release(old);
+    return program;
+}
+
+void daemon_program_reset(DaemonProgram *program)
+{
+    // globals bound by the previous request get their initial value back
+    GScope *gscope = program->gscope;
+    for (size_t j = 0; j < gscope->var_count; ++j) {
+        Variable *variable = gscope->variables[j];
+        if (variable->value == program->initial[j]) continue;
+
+        value_unref(variable->value);
+        variable->value = value_ref(program->initial[j]);
+    }
+}
+
+bool daemon_run(DaemonProgram *program, Routine *routine, Stack *mem, FrameStack *frames)
+{
+    jmp_buf trap;
+    rte_trap = &trap;
+
+    if (setjmp(trap) != 0) {
+        // frames of the calls that were running are released
+        rte_trap = NULL;
+        frames_leave(frames, 0);
+        return false;
+    }
+
+    rte_execute(routine, mem, frames, program->gscope);
+    rte_trap = NULL;
+    return true;
+}
+
+bool daemon_read_request(int fd, char *line, size_t size)
+{
+    // read up to the new line, the rest of the connection is ignored
+    size_t len = 0;
+    while (len < size-1) {
+        ssize_t n = read(fd, line + len, size-1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+
+        char *nl = memchr(line + len, '\n', n);
+        len += n;
+        if (nl != NULL) {
+            *nl = '\0';
+            return true;
+        }
+    }
+
+    line[len] = '\0';
+    return len > 0 && len < size-1;
+}
+
+void daemon_write_all(int fd, const char *buffer, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buffer, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+
+        buffer += n;
+        size -= n;
+    }
+}
+
+void daemon_serve_request(int fd)
+{
+    char line[DAEMON_REQUEST_MAX_SIZE];
+    char *reply = NULL;
+    size_t reply_size = 0;
+    FILE *out = open_memstream(&reply, &reply_size);
+    bool ok = false;
+
+    char *save = NULL;
+    char *path = daemon_read_request(fd, line, sizeof(line)) ? strtok_r(line, " \t\r", &save) : NULL;
+    char *id = path != NULL ? strtok_r(NULL, " \t\r", &save) : NULL;
+
+    DaemonProgram *program = NULL;
+    int rte_j = -1;
+    if (id == NULL) {
+        fprintf(stderr, ERR_PREFIX"Malformed request, expected 'PATH ROUTINE [VALUE...]'\n", ERR_EXP);
+    } else if ((program = daemon_program_acquire(path)) != NULL) {
+        rte_j = gscope_search_routine(program->gscope, id);
+        if (rte_j == -1) fprintf(stderr, ERR_PREFIX"Routine has not been declared: '%s'\n", ERR_EXP, id);
+    }
+
+    if (rte_j != -1) {
+        Routine *routine = program->gscope->routines[rte_j];
+        Stack *mem = st_create_from_line(save, DAEMON_STACK_CAPACITY);
+        FrameStack *frames = frames_create(DAEMON_STACK_CAPACITY);
+
+        if (program->rebound) {
+            pthread_mutex_lock(&program->lock);
+            daemon_program_reset(program);
+        }
+
+        // main checks for an empty stack at its end
+        if (routine->is_main && mem->count > 0) {
+            fprintf(stderr, ERR_PREFIX"entry point 'main' can't take parameters\n", ERR_EXP);
+        } else {
+            rte_out = out;
+            ok = daemon_run(program, routine, mem, frames);
+            if (ok && mem->count > 0) st_display(mem);
+            rte_out = NULL;
+        }
+
+        // values may come from globals, release them before the next run
+        st_destroy_from_heap(mem);
+        if (program->rebound) pthread_mutex_unlock(&program->lock);
+        frames_destroy(frames);
+    }
+
+    if (program != NULL) daemon_program_release(program);
+
+    fclose(out);
+    daemon_write_all(fd, ok ? "ok\n" : "error\n", ok ? 3 : 6);
+    daemon_write_all(fd, reply, reply_size);
+    free(reply);
+    close(fd);
+}
+
+void *daemon_worker(void *arg)
+{
+    (void) arg;
+    DaemonQueue *queue = &daemon_queue;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0) pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+        int fd = queue->fds[queue->head];
+        queue->head = (queue->head + 1) % DAEMON_QUEUE_CAPACITY;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+
+        daemon_serve_request(fd);
+    }
+
+    return NULL;
+}
+
+void daemon_serve(const char *socket_path, size_t workers)
+{
+    // runs until the process is killed
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, ERR_PREFIX"Socket path is too long: %s\n", ERR_EXP, socket_path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // a socket left behind by a previous daemon is replaced, clients that
+    // go away before their reply must not kill the daemon
+    unlink(socket_path);
+    signal(SIGPIPE, SIG_IGN);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server == -1 || bind(server, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(server, SOMAXCONN) == -1) {
+        fprintf(stderr, ERR_PREFIX"Could not listen on %s: %s\n", ERR_EXP, socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t k = 0; k < workers; ++k) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, daemon_worker, NULL) != 0) {
+            fprintf(stderr, ERR_PREFIX"Could not create daemon worker\n", ERR_EXP);
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(worker);
+    }
+
+    DaemonQueue *queue = &daemon_queue;
+    for (;;) {
+        int fd = accept(server, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, ERR_PREFIX"Could not accept connection: %s\n", ERR_EXP, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == DAEMON_QUEUE_CAPACITY) pthread_cond_wait(&queue->not_full, &queue->lock);
+        queue->fds[(queue->head + queue->count) % DAEMON_QUEUE_CAPACITY] = fd;
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+#endif // DAEMON_H_
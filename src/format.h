@@ -0,0 +1,309 @@
+#ifndef FORMAT_H_
+#define FORMAT_H_
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// buffer size large enough for any formatted int or float
+#define FMT_NUMBER_MAX_SIZE 32
+
+static const char fmt_digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+size_t fmt_uint(char *buf, uint64_t n)
+{
+    // write digits backwards two at a time, then move them in place
+    char tmp[FMT_NUMBER_MAX_SIZE];
+    char *p = tmp + sizeof(tmp);
+
+    while (n >= 100) {
+        size_t pair = (n % 100)*2;
+        n /= 100;
+        *--p = fmt_digit_pairs[pair+1];
+        *--p = fmt_digit_pairs[pair];
+    }
+
+    if (n >= 10) {
+        *--p = fmt_digit_pairs[n*2+1];
+        *--p = fmt_digit_pairs[n*2];
+    } else *--p = '0' + n;
+
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+size_t fmt_int(char *buf, long n)
+{
+    if (n < 0) {
+        *buf = '-';
+        return 1 + fmt_uint(buf+1, -(uint64_t) n);
+    }
+    return fmt_uint(buf, (uint64_t) n);
+}
+
+// Shortest round trip formatting of doubles, Grisu2 algorithm by Florian
+// Loitsch ("Printing Floating-Point Numbers Quickly and Accurately with
+// Integers"). Output always reads back to the same double and is the
+// shortest such digits sequence for the vast majority of values
+
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DIYFP_SIGNIFICAND_SIZE 52
+#define DIYFP_HIDDEN_BIT ((uint64_t) 1 << DIYFP_SIGNIFICAND_SIZE)
+#define DIYFP_SIGNIFICAND_MASK (DIYFP_HIDDEN_BIT - 1)
+#define DIYFP_EXPONENT_BIAS (0x3FF + DIYFP_SIGNIFICAND_SIZE)
+
+// normalized powers of ten 10^-348, 10^-340, ..., 10^340
+static const DiyFp fmt_cached_powers[] = {
+    {0xfa8fd5a0081c0288, -1220}, {0xbaaee17fa23ebf76, -1193}, {0x8b16fb203055ac76, -1166},
+    {0xcf42894a5dce35ea, -1140}, {0x9a6bb0aa55653b2d, -1113}, {0xe61acf033d1a45df, -1087},
+    {0xab70fe17c79ac6ca, -1060}, {0xff77b1fcbebcdc4f, -1034}, {0xbe5691ef416bd60c, -1007},
+    {0x8dd01fad907ffc3c,  -980}, {0xd3515c2831559a83,  -954}, {0x9d71ac8fada6c9b5,  -927},
+    {0xea9c227723ee8bcb,  -901}, {0xaecc49914078536d,  -874}, {0x823c12795db6ce57,  -847},
+    {0xc21094364dfb5637,  -821}, {0x9096ea6f3848984f,  -794}, {0xd77485cb25823ac7,  -768},
+    {0xa086cfcd97bf97f4,  -741}, {0xef340a98172aace5,  -715}, {0xb23867fb2a35b28e,  -688},
+    {0x84c8d4dfd2c63f3b,  -661}, {0xc5dd44271ad3cdba,  -635}, {0x936b9fcebb25c996,  -608},
+    {0xdbac6c247d62a584,  -582}, {0xa3ab66580d5fdaf6,  -555}, {0xf3e2f893dec3f126,  -529},
+    {0xb5b5ada8aaff80b8,  -502}, {0x87625f056c7c4a8b,  -475}, {0xc9bcff6034c13053,  -449},
+    {0x964e858c91ba2655,  -422}, {0xdff9772470297ebd,  -396}, {0xa6dfbd9fb8e5b88f,  -369},
+    {0xf8a95fcf88747d94,  -343}, {0xb94470938fa89bcf,  -316}, {0x8a08f0f8bf0f156b,  -289},
+    {0xcdb02555653131b6,  -263}, {0x993fe2c6d07b7fac,  -236}, {0xe45c10c42a2b3b06,  -210},
+    {0xaa242499697392d3,  -183}, {0xfd87b5f28300ca0e,  -157}, {0xbce5086492111aeb,  -130},
+    {0x8cbccc096f5088cc,  -103}, {0xd1b71758e219652c,   -77}, {0x9c40000000000000,   -50},
+    {0xe8d4a51000000000,   -24}, {0xad78ebc5ac620000,     3}, {0x813f3978f8940984,    30},
+    {0xc097ce7bc90715b3,    56}, {0x8f7e32ce7bea5c70,    83}, {0xd5d238a4abe98068,   109},
+    {0x9f4f2726179a2245,   136}, {0xed63a231d4c4fb27,   162}, {0xb0de65388cc8ada8,   189},
+    {0x83c7088e1aab65db,   216}, {0xc45d1df942711d9a,   242}, {0x924d692ca61be758,   269},
+    {0xda01ee641a708dea,   295}, {0xa26da3999aef774a,   322}, {0xf209787bb47d6b85,   348},
+    {0xb454e4a179dd1877,   375}, {0x865b86925b9bc5c2,   402}, {0xc83553c5c8965d3d,   428},
+    {0x952ab45cfa97a0b3,   455}, {0xde469fbd99a05fe3,   481}, {0xa59bc234db398c25,   508},
+    {0xf6c69a72a3989f5c,   534}, {0xb7dcbf5354e9bece,   561}, {0x88fcf317f22241e2,   588},
+    {0xcc20ce9bd35c78a5,   614}, {0x98165af37b2153df,   641}, {0xe2a0b5dc971f303a,   667},
+    {0xa8d9d1535ce3b396,   694}, {0xfb9b7cd9a4a7443c,   720}, {0xbb764c4ca7a44410,   747},
+    {0x8bab8eefb6409c1a,   774}, {0xd01fef10a657842c,   800}, {0x9b10a4e5e9913129,   827},
+    {0xe7109bfba19c0c9d,   853}, {0xac2820d9623bf429,   880}, {0x80444b5e7aa7cf85,   907},
+    {0xbf21e44003acdd2d,   933}, {0x8e679c2f5e44ff8f,   960}, {0xd433179d9c8cb841,   986},
+    {0x9e19db92b4e31ba9,  1013}, {0xeb96bf6ebadf77d9,  1039}, {0xaf87023b9bf0ee6b,  1066},
+};
+
+static const uint64_t fmt_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+    1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+DiyFp diyfp_from_double(double d)
+{
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+
+    int biased_e = (int) ((bits >> DIYFP_SIGNIFICAND_SIZE) & 0x7FF);
+    uint64_t significand = bits & DIYFP_SIGNIFICAND_MASK;
+
+    if (biased_e != 0) return (DiyFp) {significand + DIYFP_HIDDEN_BIT, biased_e - DIYFP_EXPONENT_BIAS};
+    else return (DiyFp) {significand, 1 - DIYFP_EXPONENT_BIAS};
+}
+
+DiyFp diyfp_normalize(DiyFp x)
+{
+    int shift = __builtin_clzll(x.f);
+    return (DiyFp) {x.f << shift, x.e - shift};
+}
+
+DiyFp diyfp_multiply(DiyFp x, DiyFp y)
+{
+    unsigned __int128 p = (unsigned __int128) x.f * y.f;
+    uint64_t h = (uint64_t) (p >> 64);
+    uint64_t l = (uint64_t) p;
+
+    // round to nearest
+    h += l >> 63;
+    return (DiyFp) {h, x.e + y.e + 64};
+}
+
+void diyfp_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+    DiyFp pl = diyfp_normalize((DiyFp) {(v.f << 1) + 1, v.e - 1});
+    DiyFp mi = (v.f == DIYFP_HIDDEN_BIT) ? (DiyFp) {(v.f << 2) - 1, v.e - 2} : (DiyFp) {(v.f << 1) - 1, v.e - 1};
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *plus = pl;
+    *minus = mi;
+}
+
+DiyFp grisu_cached_power(int e, int *k)
+{
+    // 0.30102999566398114 = 1/lg(10)
+    double dk = (-61 - e)*0.30102999566398114 + 347;
+    int ik = (int) dk;
+    if (dk - ik > 0.0) ik++;
+
+    unsigned index = (unsigned) ((ik >> 3) + 1);
+    *k = -(-348 + (int) (index << 3));
+    return fmt_cached_powers[index];
+}
+
+void grisu_round(char *digits, size_t len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        digits[len-1]--;
+        rest += ten_kappa;
+    }
+}
+
+int grisu_count_digits(uint32_t n)
+{
+    int count = 1;
+    while (count < 10 && n >= fmt_pow10[count]) count++;
+    return count;
+}
+
+void grisu_digit_gen(DiyFp w, DiyFp mp, uint64_t delta, char *digits, size_t *len, int *k)
+{
+    DiyFp one = {(uint64_t) 1 << -mp.e, mp.e};
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t) (mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = grisu_count_digits(p1);
+    *len = 0;
+
+    // integral part
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t) fmt_pow10[kappa-1];
+        p1 %= (uint32_t) fmt_pow10[kappa-1];
+        if (d || *len) digits[(*len)++] = '0' + d;
+        kappa--;
+
+        uint64_t tmp = ((uint64_t) p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *k += kappa;
+            grisu_round(digits, *len, delta, tmp, fmt_pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    // fractional part
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char) (p2 >> -one.e);
+        if (d || *len) digits[(*len)++] = '0' + d;
+        p2 &= one.f - 1;
+        kappa--;
+
+        if (p2 < delta) {
+            *k += kappa;
+            int index = -kappa;
+            grisu_round(digits, *len, delta, p2, one.f, wp_w*(index < 20 ? fmt_pow10[index] : 0));
+            return;
+        }
+    }
+}
+
+void grisu2(double value, char *digits, size_t *len, int *k)
+{
+    DiyFp v = diyfp_from_double(value);
+    DiyFp w_m, w_p;
+    diyfp_boundaries(v, &w_m, &w_p);
+
+    DiyFp c_mk = grisu_cached_power(w_p.e, k);
+    DiyFp w = diyfp_multiply(diyfp_normalize(v), c_mk);
+    DiyFp wp = diyfp_multiply(w_p, c_mk);
+    DiyFp wm = diyfp_multiply(w_m, c_mk);
+    wm.f++;
+    wp.f--;
+
+    grisu_digit_gen(w, wp, wp.f - wm.f, digits, len, k);
+}
+
+size_t fmt_float(char *buf, double x)
+{
+    char *p = buf;
+
+    if (isnan(x)) {
+        strcpy(buf, "nan");
+        return 3;
+    }
+
+    if (signbit(x)) {
+        *p++ = '-';
+        x = -x;
+    }
+
+    if (x == 0) {
+        strcpy(p, "0.0");
+        return p - buf + 3;
+    }
+
+    if (isinf(x)) {
+        strcpy(p, "inf");
+        return p - buf + 3;
+    }
+
+    // value is digits*10^k
+    char digits[FMT_NUMBER_MAX_SIZE];
+    size_t len;
+    int k;
+    grisu2(x, digits, &len, &k);
+
+    // position of the decimal point relative to the first digit
+    int point = (int) len + k;
+
+    if (point > 0 && point <= 21) {
+        if ((size_t) point >= len) {
+            // integral value, pad with zeros and keep it recognizable as float
+            memcpy(p, digits, len);
+            memset(p + len, '0', point - len);
+            p += point;
+            memcpy(p, ".0", 2);
+            p += 2;
+        } else {
+            memcpy(p, digits, point);
+            p[point] = '.';
+            memcpy(p + point + 1, digits + point, len - point);
+            p += len + 1;
+        }
+    } else if (point <= 0 && point > -6) {
+        memcpy(p, "0.", 2);
+        memset(p + 2, '0', -point);
+        memcpy(p + 2 - point, digits, len);
+        p += 2 - point + len;
+    } else {
+        // scientific notation
+        *p++ = digits[0];
+        if (len > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, len - 1);
+            p += len - 1;
+        }
+        *p++ = 'e';
+        int exp = point - 1;
+        if (exp < 0) {
+            *p++ = '-';
+            exp = -exp;
+        } else *p++ = '+';
+        p += fmt_uint(p, (uint64_t) exp);
+    }
+
+    *p = '\0';
+    return p - buf;
+}
+
+#endif  // FORMAT_H_
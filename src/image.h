@@ -0,0 +1,354 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "interpreter.h"
+#include "lexer.h"
+#include "stack.h"
+
+// Images: the gscope of a compiled program (routines and their code,
+// variables with their current values, constants and module) written as a
+// single block. Pointers are stored as offsets from the start of the image
+// and listed in a fixup table, loading maps the file privately and adds the
+// address of the mapping to each of them. Pages without pointers, like code
+// and token arrays, are never written and stay shared with the page cache.
+//
+// Values in the image are marked shared so they are never released, values
+// bound after loading are regular ones. A table held in several places is
+// saved once and they all point to it after loading, like before saving.
+// Images are only valid for the build that wrote them, the layout of the
+// structs is checked on load
+
+#define IMAGE_MAGIC "PANCAKE"
+#define IMAGE_VERSION 6
+#define IMAGE_ALIGN 16
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout[7];
+    uint64_t size;
+    uint64_t gscope;
+    uint64_t fixups;
+    uint64_t fixup_count;
+} ImageHeader;
+
+typedef struct {
+    Table *table;
+    size_t at;
+} ImageTable;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+
+    // offsets of the pointers written so far
+    uint64_t *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+
+    // tables written so far and their offsets, open addressing on the pointer
+    ImageTable *tables;
+    size_t table_count;
+    size_t table_capacity;
+} ImageWriter;
+
+void image_layout(uint32_t *layout)
+{
+    layout[0] = sizeof(void *);
+    layout[1] = sizeof(GScope);
+    layout[2] = sizeof(Routine);
+    layout[3] = sizeof(Variable);
+    layout[4] = sizeof(Value);
+    layout[5] = sizeof(Instr);
+    layout[6] = sizeof(Module);
+}
+
+size_t image_alloc(ImageWriter *writer, size_t size)
+{
+    // zeroed block aligned for any field, data moves as it grows so blocks
+    // are referred to by offset
+    size_t at = (writer->size + IMAGE_ALIGN-1) & ~(size_t) (IMAGE_ALIGN-1);
+
+    if (at + size > writer->capacity) {
+        while (at + size > writer->capacity)
+            writer->capacity = writer->capacity == 0 ? 4096 : (writer->capacity*2);
+        writer->data = mem_realloc(MEM_SCOPE, writer->data, writer->capacity);
+    }
+
+    memset(writer->data + writer->size, 0, at + size - writer->size);
+    writer->size = at + size;
+    return at;
+}
+
+size_t image_put(ImageWriter *writer, const void *src, size_t size)
+{
+    size_t at = image_alloc(writer, size);
+    if (size > 0) memcpy(writer->data + at, src, size);
+    return at;
+}
+
+size_t image_put_string(ImageWriter *writer, const char *txt)
+{
+    return image_put(writer, txt, strlen(txt)+1);
+}
+
+void image_link(ImageWriter *writer, size_t field, size_t target)
+{
+    // the pointer at field points to target once loaded
+    uintptr_t offset = target;
+    memcpy(writer->data + field, &offset, sizeof(offset));
+
+    if (writer->fixup_count == writer->fixup_capacity) {
+        writer->fixup_capacity = writer->fixup_capacity == 0 ? 256 : (writer->fixup_capacity*2);
+        writer->fixups = mem_realloc(MEM_SCOPE, writer->fixups, writer->fixup_capacity*sizeof(*writer->fixups));
+    }
+
+    writer->fixups[writer->fixup_count++] = field;
+}
+
+ImageTable *image_find_table(ImageWriter *writer, Table *table)
+{
+    // the slot of table, empty when it has not been written yet
+    if ((writer->table_count + 1)*2 > writer->table_capacity) {
+        ImageTable *tables = writer->tables;
+        size_t capacity = writer->table_capacity;
+
+        writer->table_capacity = capacity == 0 ? 64 : (capacity*2);
+        writer->tables = mem_calloc(MEM_SCOPE, writer->table_capacity, sizeof(*writer->tables));
+        writer->table_count = 0;
+        for (size_t k = 0; k < capacity; ++k) {
+            if (tables[k].table == NULL) continue;
+            *image_find_table(writer, tables[k].table) = tables[k];
+            writer->table_count++;
+        }
+        mem_free(tables);
+    }
+
+    size_t mask = writer->table_capacity - 1;
+    size_t k = (size_t) table_mix((uint64_t) (uintptr_t) table) & mask;
+    while (writer->tables[k].table != NULL && writer->tables[k].table != table) k = (k+1) & mask;
+    return &writer->tables[k];
+}
+
+size_t image_put_value(ImageWriter *writer, Value *value)
+{
+    if (value->type == VT_TASK) {
+        fprintf(stderr, ERR_PREFIX"Tasks can't be saved in an image\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t at = image_put(writer, value, sizeof(Value));
+    Value *copy = (Value *) (writer->data + at);
+    copy->shared = true;
+    copy->refs = 1;
+
+    if (value->type == VT_STRING) {
+        // a buffer of its own, exactly full so it is never appended to
+        size_t buf = image_alloc(writer, sizeof(StrBuf) + value->len + 1);
+        StrBuf *buf_copy = (StrBuf *) (writer->data + buf);
+        buf_copy->refs = 1;
+        buf_copy->fill = value->len;
+        buf_copy->capacity = (size_t) value->len + 1;
+        memcpy(buf_copy->data, value->txt, value->len);
+
+        copy = (Value *) (writer->data + at);
+        copy->start = 0;
+        copy->view = false;
+        image_link(writer, at + offsetof(Value, txt), buf + offsetof(StrBuf, data));
+    }
+
+    if (value->type == VT_TABLE) {
+        // written once, other references link to the same copy. Recorded
+        // before its entries, which may lead back to it
+        Table *table = value->table;
+        ImageTable *seen = image_find_table(writer, table);
+        if (seen->table != NULL) {
+            image_link(writer, at + offsetof(Value, table), seen->at);
+            return at;
+        }
+
+        // the arrays are borrowed from the image until the table grows
+        size_t at_table = image_put(writer, table, sizeof(Table));
+        *seen = (ImageTable) {table, at_table};
+        writer->table_count++;
+
+        ((Table *) (writer->data + at_table))->borrowed = true;
+        ((Table *) (writer->data + at_table))->lock = 0;
+
+        image_link(writer, at_table + offsetof(Table, ctrl), image_put(writer, table->ctrl, table->capacity + TABLE_GROUP-1));
+        size_t entries = image_put(writer, table->entries, table->capacity*sizeof(*table->entries));
+        for (size_t k = 0; k < table->capacity; ++k) {
+            if (table->ctrl[k] < 0) continue;
+            size_t entry = entries + k*sizeof(*table->entries);
+            image_link(writer, entry + offsetof(TableEntry, key), image_put_value(writer, table->entries[k].key));
+            image_link(writer, entry + offsetof(TableEntry, value), image_put_value(writer, table->entries[k].value));
+        }
+        image_link(writer, at_table + offsetof(Table, entries), entries);
+        image_link(writer, at + offsetof(Value, table), at_table);
+    }
+
+    if (value->type == VT_ARRAY) {
+        Array *array = value->array;
+        size_t items = image_put(writer, array, sizeof(Array) + array->count*sizeof(*array->items));
+        for (size_t k = 0; k < array->count; ++k)
+            image_link(writer, items + offsetof(Array, items) + k*sizeof(*array->items), image_put_value(writer, array->items[k]));
+        image_link(writer, at + offsetof(Value, array), items);
+    }
+    return at;
+}
+
+size_t image_put_module(ImageWriter *writer, Module *mod)
+{
+    size_t at = image_put(writer, mod, sizeof(Module));
+    image_link(writer, at + offsetof(Module, types), image_put(writer, mod->types, mod->count*sizeof(*mod->types)));
+    image_link(writer, at + offsetof(Module, txt_offsets), image_put(writer, mod->txt_offsets, mod->count*sizeof(*mod->txt_offsets)));
+    image_link(writer, at + offsetof(Module, txt_lens), image_put(writer, mod->txt_lens, mod->count*sizeof(*mod->txt_lens)));
+    image_link(writer, at + offsetof(Module, locs), image_put(writer, mod->locs, mod->count*sizeof(*mod->locs)));
+    image_link(writer, at + offsetof(Module, text), image_put(writer, mod->text, mod->text_size));
+    image_link(writer, at + offsetof(Module, file_path), image_put_string(writer, mod->file_path));
+    return at;
+}
+
+size_t image_put_routine(ImageWriter *writer, Routine *routine, size_t *id)
+{
+    assert(routine->state == COMPILE_DONE);
+
+    size_t at = image_put(writer, routine, sizeof(Routine));
+    *id = image_put_string(writer, routine->id);
+    image_link(writer, at + offsetof(Routine, id), *id);
+    image_link(writer, at + offsetof(Routine, code), image_put(writer, routine->code, routine->code_count*sizeof(*routine->code)));
+
+    size_t slot_ids = image_alloc(writer, routine->slot_count*sizeof(*routine->slot_ids));
+    for (size_t k = 0; k < routine->slot_count; ++k)
+        image_link(writer, slot_ids + k*sizeof(*routine->slot_ids), image_put_string(writer, routine->slot_ids[k]));
+    image_link(writer, at + offsetof(Routine, slot_ids), slot_ids);
+    return at;
+}
+
+void image_put_symbols(ImageWriter *writer, size_t field, SymbolIndex *index, size_t *ids)
+{
+    // ids are the offsets of the names the symbols borrow
+    size_t slots = image_put(writer, index->slots, index->capacity*sizeof(*index->slots));
+    for (size_t k = 0; k < index->capacity; ++k) {
+        if (index->slots[k].id != NULL)
+            image_link(writer, slots + k*sizeof(*index->slots) + offsetof(Symbol, id), ids[index->slots[k].j]);
+    }
+    image_link(writer, field + offsetof(SymbolIndex, slots), slots);
+}
+
+void image_save(GScope *gscope, const char *path)
+{
+    ImageWriter writer = {0};
+    size_t header = image_alloc(&writer, sizeof(ImageHeader));
+
+    size_t at = image_put(&writer, gscope, sizeof(GScope));
+    GScope *copy = (GScope *) (writer.data + at);
+    copy->rte_capacity = copy->rte_count;
+    copy->var_capacity = copy->var_count;
+    copy->const_capacity = copy->const_count;
+    copy->image = NULL;
+    copy->image_size = 0;
+
+    size_t *rte_ids = mem_alloc(MEM_SCOPE, (gscope->rte_count+1)*sizeof(*rte_ids));
+    size_t routines = image_alloc(&writer, gscope->rte_count*sizeof(*gscope->routines));
+    for (size_t j = 0; j < gscope->rte_count; ++j)
+        image_link(&writer, routines + j*sizeof(*gscope->routines), image_put_routine(&writer, gscope->routines[j], &rte_ids[j]));
+    image_link(&writer, at + offsetof(GScope, routines), routines);
+
+    size_t *var_ids = mem_alloc(MEM_SCOPE, (gscope->var_count+1)*sizeof(*var_ids));
+    size_t variables = image_alloc(&writer, gscope->var_count*sizeof(*gscope->variables));
+    for (size_t j = 0; j < gscope->var_count; ++j) {
+        Variable *variable = gscope->variables[j];
+        size_t var = image_put(&writer, variable, sizeof(Variable));
+        var_ids[j] = image_put_string(&writer, variable->id);
+        image_link(&writer, var + offsetof(Variable, id), var_ids[j]);
+        image_link(&writer, var + offsetof(Variable, value), image_put_value(&writer, variable->value));
+        image_link(&writer, variables + j*sizeof(*gscope->variables), var);
+    }
+    image_link(&writer, at + offsetof(GScope, variables), variables);
+
+    image_put_symbols(&writer, at + offsetof(GScope, rte_symbols), &gscope->rte_symbols, rte_ids);
+    image_put_symbols(&writer, at + offsetof(GScope, var_symbols), &gscope->var_symbols, var_ids);
+
+    size_t constants = image_alloc(&writer, gscope->const_count*sizeof(*gscope->constants));
+    for (size_t i = 0; i < gscope->const_count; ++i)
+        image_link(&writer, constants + i*sizeof(*gscope->constants), image_put_value(&writer, gscope->constants[i]));
+    image_link(&writer, at + offsetof(GScope, constants), constants);
+    image_link(&writer, at + offsetof(GScope, mod), image_put_module(&writer, gscope->mod));
+
+    // fixup table last, it is not part of itself
+    size_t fixup_count = writer.fixup_count;
+    size_t fixups = image_put(&writer, writer.fixups, fixup_count*sizeof(*writer.fixups));
+
+    ImageHeader *h = (ImageHeader *) (writer.data + header);
+    memcpy(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    h->version = IMAGE_VERSION;
+    image_layout(h->layout);
+    h->size = writer.size;
+    h->gscope = at;
+    h->fixups = fixups;
+    h->fixup_count = fixup_count;
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(writer.data, 1, writer.size, file) != writer.size || fclose(file) != 0) {
+        fprintf(stderr, ERR_PREFIX"Could not write image: %s\n", ERR_EXP, path);
+        exit(EXIT_FAILURE);
+    }
+
+    mem_free(rte_ids);
+    mem_free(var_ids);
+    mem_free(writer.fixups);
+    mem_free(writer.tables);
+    mem_free(writer.data);
+}
+
+GScope *image_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, ERR_PREFIX"Could not open image: %s\n", ERR_EXP, path);
+        exit(EXIT_FAILURE);
+    }
+
+    // private mapping, fixups and variables bound at run time are copied on write
+    size_t size = (size_t) st.st_size;
+    char *base = size >= sizeof(ImageHeader) ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, ERR_PREFIX"Could not map image: %s\n", ERR_EXP, path);
+        exit(EXIT_FAILURE);
+    }
+
+    ImageHeader *header = (ImageHeader *) base;
+    uint32_t layout[7];
+    image_layout(layout);
+
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header->version != IMAGE_VERSION ||
+        memcmp(header->layout, layout, sizeof(layout)) != 0 || header->size != size ||
+        header->fixups + header->fixup_count*sizeof(uint64_t) > size) {
+        fprintf(stderr, ERR_PREFIX"Not an image of this build of pancake: %s\n", ERR_EXP, path);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t *fixups = (uint64_t *) (base + header->fixups);
+    for (size_t i = 0; i < header->fixup_count; ++i) {
+        assert(fixups[i] + sizeof(uintptr_t) <= size);
+        *(uintptr_t *) (base + fixups[i]) += (uintptr_t) base;
+    }
+
+    GScope *gscope = (GScope *) (base + header->gscope);
+    gscope->image = base;
+    gscope->image_size = size;
+    return gscope;
+}
+
+#endif // IMAGE_H_
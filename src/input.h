@@ -0,0 +1,244 @@
+#ifndef INPUT_H_
+#define INPUT_H_
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trap.h"
+#include "interpreter.h"
+#include "scan.h"
+#include "stack.h"
+
+// Line input for read-line and each-line. Regular files are mapped and lines
+// point straight into the mapping, pipes and terminals are read through one
+// large buffer reused for the whole stream, a line longer than the buffer
+// makes it grow. each-line hands lines to its routine as views, valid until
+// the next line, and copies the ones the routine kept (see value_materialize).
+// The reader of stdin stays open until input_release at the end of the program
+
+#define INPUT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    int fd;
+    bool mapped;
+    bool eof;
+
+    // each-line is going through it, views point into data
+    bool busy;
+
+    // lines are data[pos..size), pos is the start of the next one
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t pos;
+} LineReader;
+
+// read-line and each-line "-" share the reader of stdin
+LineReader input_stdin;
+bool input_stdin_open = false;
+pthread_mutex_t input_stdin_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void reader_open(LineReader *reader, int fd)
+{
+    *reader = (LineReader) {.fd = fd};
+
+    // mapped whole when read from the start, the rest goes through the buffer
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0 || lseek(fd, 0, SEEK_CUR) != 0) return;
+
+    char *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return;
+
+    madvise(data, (size_t) st.st_size, MADV_SEQUENTIAL);
+    reader->data = data;
+    reader->size = (size_t) st.st_size;
+    reader->mapped = true;
+    reader->eof = true;
+}
+
+bool reader_fill(LineReader *reader)
+{
+    // the partial line moves to the front and more is read after it
+    if (reader->eof) return false;
+
+    if (reader->pos > 0) {
+        memmove(reader->data, reader->data + reader->pos, reader->size - reader->pos);
+        reader->size -= reader->pos;
+        reader->pos = 0;
+    }
+
+    if (reader->size == reader->capacity) {
+        reader->capacity = reader->capacity == 0 ? INPUT_BUFFER_SIZE : (reader->capacity*2);
+        reader->data = mem_realloc(MEM_VALUES, reader->data, reader->capacity);
+    }
+
+    ssize_t n;
+    do n = read(reader->fd, reader->data + reader->size, reader->capacity - reader->size);
+    while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        fprintf(stderr, ERR_PREFIX"Could not read input: %s\n", ERR_EXP, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (n == 0) {
+        reader->eof = true;
+        return false;
+    }
+
+    reader->size += (size_t) n;
+    return true;
+}
+
+bool reader_next(LineReader *reader, const char **line, size_t *len)
+{
+    // next line without its "\n" or "\r\n", the last one may miss it
+    size_t end = scan_find_byte(reader->data, reader->pos, reader->size, '\n');
+    while (end == reader->size) {
+        // filling moves the partial line to the front
+        size_t scanned = reader->size - reader->pos;
+        bool more = reader_fill(reader);
+        end = scan_find_byte(reader->data, reader->pos + scanned, reader->size, '\n');
+        if (!more) break;
+    }
+
+    if (reader->pos == reader->size) return false;
+
+    *line = reader->data + reader->pos;
+    *len = end - reader->pos;
+    reader->pos = end < reader->size ? end+1 : end;
+
+    if (*len > 0 && (*line)[*len-1] == '\r') (*len)--;
+    return true;
+}
+
+void reader_close(LineReader *reader)
+{
+    if (reader->mapped) munmap(reader->data, reader->size);
+    else mem_free(reader->data);
+    if (reader->fd != STDIN_FILENO) close(reader->fd);
+}
+
+LineReader *input_stdin_acquire(void)
+{
+    // nothing else may read stdin while each-line goes through it
+    pthread_mutex_lock(&input_stdin_lock);
+    if (!input_stdin_open) {
+        reader_open(&input_stdin, STDIN_FILENO);
+        input_stdin_open = true;
+    }
+
+    if (input_stdin.busy) {
+        pthread_mutex_unlock(&input_stdin_lock);
+        fprintf(stderr, ERR_PREFIX"Can't read stdin while each-line goes through it\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+    return &input_stdin;
+}
+
+void input_release(void)
+{
+    pthread_mutex_lock(&input_stdin_lock);
+    if (input_stdin_open) reader_close(&input_stdin);
+    input_stdin_open = false;
+    pthread_mutex_unlock(&input_stdin_lock);
+}
+
+Value *input_read_line(void)
+{
+    // an owned copy of the next line of stdin, NULL at the end
+    LineReader *reader = input_stdin_acquire();
+
+    const char *txt;
+    size_t len;
+    Value *line = reader_next(reader, &txt, &len) ? value_create_string_len(txt, len) : NULL;
+
+    pthread_mutex_unlock(&input_stdin_lock);
+    return line;
+}
+
+void input_each_line_release(LineReader *reader)
+{
+    if (reader == &input_stdin) {
+        pthread_mutex_lock(&input_stdin_lock);
+        reader->busy = false;
+        pthread_mutex_unlock(&input_stdin_lock);
+    } else {
+        reader_close(reader);
+    }
+}
+
+void input_each_line(GScope *gscope, Routine *routine, Value *path, Stack *mem, FrameStack *frames)
+{
+    // takes over the reference to path, released on errors too
+    LineReader file;
+    LineReader *reader = &file;
+
+    if (path->len == 1 && path->txt[0] == '-') {
+        reader = input_stdin_acquire();
+        reader->busy = true;
+        pthread_mutex_unlock(&input_stdin_lock);
+    } else {
+        char *file_path = mem_alloc(MEM_VALUES, path->len+1);
+        memcpy(file_path, path->txt, path->len);
+        file_path[path->len] = '\0';
+
+        int fd = open(file_path, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, ERR_PREFIX"Could not open file: %s\n", ERR_EXP, file_path);
+            mem_free(file_path);
+            value_unref(path);
+            exit(EXIT_FAILURE);
+        }
+        mem_free(file_path);
+        reader_open(reader, fd);
+    }
+
+    // views are only safe while no task can see them
+    bool views = !VALUES_ATOMIC();
+    Value *volatile line = NULL;
+
+    // an error in the routine may be recovered from by the library or the
+    // daemon, the reader is released before passing it on
+    jmp_buf trap;
+    jmp_buf *outer = rte_trap;
+    rte_trap = &trap;
+
+    if (setjmp(trap) != 0) {
+        rte_trap = outer;
+        if (line != NULL) {
+            if (views && line->refs > 1) value_materialize(line);
+            value_unref(line);
+        }
+        input_each_line_release(reader);
+        value_unref(path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (routine->state != COMPILE_DONE) rte_compile(gscope, routine);
+
+    const char *txt;
+    size_t len;
+    while (reader_next(reader, &txt, &len)) {
+        line = views ? value_create_view(txt, len) : value_create_string_len(txt, len);
+        st_push(mem, value_ref(line));
+        rte_execute(routine, mem, frames, gscope);
+
+        // kept by the routine, on a stack, in a variable or an array
+        if (views && line->refs > 1) value_materialize(line);
+        value_unref(line);
+        line = NULL;
+    }
+
+    rte_trap = outer;
+    input_each_line_release(reader);
+    value_unref(path);
+}
+
+#endif  // INPUT_H_
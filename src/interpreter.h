@@ -1,56 +1,105 @@
 #ifndef INTERPRETER_H_
 #define INTERPRETER_H_
 
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "lexer.h"
+#include "memstats.h"
+#include "profiler.h"
 #include "stack.h"
-
-#define CHECK_LAST_NUMBERS_TYPE(mem, message)                       \
-do {                                                                \
-    if (atoi(st_peek(mem, 0)->txt) == 0 || atoi(st_peek(mem, 1)->txt) == 0) { \
-        fprintf(stderr, message);                                   \
-        exit(EXIT_FAILURE);                                         \
-    }                                                               \
-} while (0)                                                         \
-
-#define RETRIEVE_LAST_NUMBERS_FLOAT(x, y, mem) \
-do {                                           \
-    char *a = st_peek(mem, 0)->txt;                 \
-    char *b = st_peek(mem, 1)->txt;                 \
-    float x_res = atof(a);                     \
-    float y_res = atof(b);                     \
-    st_pop(mem);                               \
-    st_pop(mem);                               \
-    *x = x_res;                                \
-    *y = y_res;                                \
-} while (0)                                    \
+#include "table.h"
+#include "text.h"
+#include "trace.h"
 
 #define GSCOPE_ROUTINES_INITIAL_CAPACITY 16
 #define GSCOPE_VARIABLES_INITIAL_CAPACITY 32
-#define TOKENS_INITIAL_CAPACITY 64
+#define CODE_INITIAL_CAPACITY 64
+
+// routines whose body has at most this many tokens get inlined into callers
+#define INLINE_DEFAULT_THRESHOLD 8
 
 typedef struct {
     char *id;
     Value *value;
+
+    // variables that are never the target of a bind are read as constants,
+    // constant is their index in the gscope pool once one has been taken
+    bool rebound;
+    long constant;
+
+    // held while tasks bind or read the value, see var_get
+    int lock;
 } Variable;
 
+typedef enum {
+    COMPILE_PENDING,
+    COMPILE_ACTIVE,
+    COMPILE_DONE,
+} CompileState;
+
+// compiled token: op is a TokenType, src the token of the module it comes
+// from (for text and location) and arg the operand filled in by compilation:
+// relative offset of the branch target for KW_IF and KW_ELSE, index of the
+// routine or variable for RTE_CALL, KW_SPAWN, KW_MAP, KW_REDUCE, KW_EACH_LINE,
+// VAR_LOAD and VAR_STORE, frame slot for
+// LOCAL_LOAD and LOCAL_STORE, constant pool index for CONST_LOAD
 typedef struct {
-    size_t var_count;
-    Variable var[8];
-} Parameters;
+    uint32_t op;
+    uint32_t src;
+    long arg;
+} Instr;
 
 typedef struct {
     char *id;
-    Token **tokens;
-    size_t tk_count;
-    size_t tk_capacity;
-    // Parameters *params;
+    size_t index;
+
+    // body is a range of the module tokens until compiled into code
+    size_t src_start;
+    size_t src_count;
+    Instr *code;
+    size_t code_count;
+    size_t code_capacity;
+
+    // routines are compiled once, before main or on their first call
+    CompileState state;
+    bool recursive;
+
+    // the entry point, it must leave the stack empty
+    bool is_main;
+
+    // names of the frame slots, parameters first then locals
+    char **slot_ids;
+    size_t param_count;
+    size_t slot_count;
+    size_t slot_capacity;
 } Routine;
 
+// every call takes slot_count slots on top of the frame stack, a NULL slot
+// is a local that has not been assigned yet
+typedef struct {
+    Value **slots;
+    size_t count;
+    size_t capacity;
+} FrameStack;
+
+// open addressing table from names to positions in the gscope arrays, the
+// ids are borrowed from the routines and variables
+typedef struct {
+    const char *id;
+    size_t j;
+} Symbol;
+
+typedef struct {
+    Symbol *slots;
+    size_t capacity;
+    size_t count;
+} SymbolIndex;
+
 typedef struct {
     Routine **routines;
     Variable **variables;
@@ -58,77 +107,833 @@ typedef struct {
     size_t rte_count;
     size_t var_capacity;
     size_t var_count;
+
+    SymbolIndex rte_symbols;
+    SymbolIndex var_symbols;
+
+    // values of literals and constant variables, pushed by CONST_LOAD
+    Value **constants;
+    size_t const_count;
+    size_t const_capacity;
+
+    // routines whose body has at most this many tokens are inlined, 0 disables
+    size_t inline_threshold;
+
+    // tokens of the routines, owned by the gscope
+    Module *mod;
+
+    // mapping holding everything above when loaded from an image
+    void *image;
+    size_t image_size;
 } GScope;
 
 Variable *var_create(char *id, Value *value)
 {
-    Variable *variable = malloc(sizeof(Variable));
-    variable->id = id;
+    Variable *variable = mem_alloc(MEM_SCOPE, sizeof(Variable));
+    variable->id = mem_strdup(MEM_SCOPE, id);
     variable->value = value;
+
+    // until gscope_mark_rebound_variables runs nothing is a constant
+    variable->rebound = true;
+    variable->constant = -1;
+    variable->lock = 0;
     return variable;
 }
 
+void var_lock(Variable *variable)
+{
+    // held for a pointer swap at most, spinning is cheaper than sleeping
+    while (__atomic_exchange_n(&variable->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&variable->lock, __ATOMIC_RELAXED)) {}
+}
+
+void var_unlock(Variable *variable)
+{
+    __atomic_store_n(&variable->lock, 0, __ATOMIC_RELEASE);
+}
+
+Value *var_get(Variable *variable)
+{
+    // once tasks run another thread may bind the variable and release the
+    // old value, the reference is taken before that can happen
+    if (!VALUES_ATOMIC()) return value_ref(variable->value);
+
+    var_lock(variable);
+    Value *value = value_ref(variable->value);
+    var_unlock(variable);
+    return value;
+}
+
+void var_set(Variable *variable, Value *value)
+{
+    // takes over the reference of the caller
+    Value *old_value = variable->value;
+    if (VALUES_ATOMIC()) {
+        var_lock(variable);
+        old_value = variable->value;
+        variable->value = value;
+        var_unlock(variable);
+    } else variable->value = value;
+
+    value_unref(old_value);
+}
+
 void var_destroy(Variable *variable)
 {
-    free(variable);
+    value_unref(variable->value);
+    mem_free(variable->id);
+    mem_free(variable);
+}
+
+size_t symbols_hash(const char *id)
+{
+    // FNV-1a
+    size_t hash = 14695981039346656037UL;
+    while (*id) {
+        hash ^= (unsigned char) *id++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+int symbols_find(SymbolIndex *index, const char *id)
+{
+    if (index->capacity == 0) return -1;
+
+    size_t mask = index->capacity - 1;
+    for (size_t k = symbols_hash(id) & mask;; k = (k+1) & mask) {
+        Symbol *slot = &index->slots[k];
+        if (slot->id == NULL) return -1;
+        if (strcmp(slot->id, id) == 0) return (int) slot->j;
+    }
+}
+
+void symbols_insert(SymbolIndex *index, const char *id, size_t j)
+{
+    // keep the load factor under one half, capacity is a power of two
+    if ((index->count+1)*2 > index->capacity) {
+        Symbol *slots = index->slots;
+        size_t capacity = index->capacity;
+
+        index->capacity = capacity == 0 ? 64 : capacity*2;
+        index->slots = mem_calloc(MEM_SCOPE, index->capacity, sizeof(*index->slots));
+        index->count = 0;
+
+        for (size_t k = 0; k < capacity; ++k) {
+            if (slots[k].id != NULL) symbols_insert(index, slots[k].id, slots[k].j);
+        }
+        mem_free(slots);
+    }
+
+    size_t mask = index->capacity - 1;
+    size_t k = symbols_hash(id) & mask;
+    while (index->slots[k].id != NULL) {
+        // names declared twice resolve to the first declaration
+        if (strcmp(index->slots[k].id, id) == 0) return;
+        k = (k+1) & mask;
+    }
+
+    index->slots[k] = (Symbol) {.id = id, .j = j};
+    index->count++;
+}
+
+void symbols_clear(SymbolIndex *index)
+{
+    if (index->capacity > 0) memset(index->slots, 0, index->capacity*sizeof(*index->slots));
+    index->count = 0;
+}
+
+size_t gscope_append_constant(GScope *gscope, Value *value)
+{
+    // the pool takes over the reference of the caller
+    if (gscope->const_count == gscope->const_capacity) {
+        gscope->const_capacity = gscope->const_capacity == 0 ? 64 : (gscope->const_capacity*2);
+        gscope->constants = mem_realloc(MEM_SCOPE, gscope->constants, gscope->const_capacity*sizeof(*gscope->constants));
+    }
+
+    gscope->constants[gscope->const_count] = value;
+    return gscope->const_count++;
 }
 
 int gscope_search_routine(GScope *gscope, char *id)
 {
-    size_t j = 0;
-    while (j < gscope->rte_count && strcmp(id, gscope->routines[j]->id) != 0) j++;
-    if (j == gscope->rte_count) return -1;
-    else return j;
+    return symbols_find(&gscope->rte_symbols, id);
 }
 
 int gscope_search_variable(GScope *gscope, char *id)
 {
-    size_t j = 0;
-    while (j < gscope->var_count && strcmp(id, gscope->variables[j]->id) != 0) j++;
-    if (j == gscope->var_count) return -1;
-    else return j;
+    return symbols_find(&gscope->var_symbols, id);
 }
 
-Routine *rte_create(char *id, const size_t tokens_initial_capacity)
+Routine *rte_create(char *id)
 {
-    Routine *routine = malloc(sizeof(Routine));
-    routine->id = id;
+    Routine *routine = mem_alloc(MEM_SCOPE, sizeof(Routine));
+    routine->id = mem_strdup(MEM_SCOPE, id);
+
+    routine->state = COMPILE_PENDING;
+    routine->recursive = false;
+    routine->is_main = strcmp(id, "main") == 0;
+
+    routine->slot_ids = NULL;
+    routine->param_count = 0;
+    routine->slot_count = 0;
+    routine->slot_capacity = 0;
 
-    routine->tk_count = 0;
-    routine->tk_capacity = tokens_initial_capacity;
-    routine->tokens = calloc(tokens_initial_capacity, sizeof(*routine->tokens));
+    routine->src_start = 0;
+    routine->src_count = 0;
+    routine->code = NULL;
+    routine->code_count = 0;
+    routine->code_capacity = 0;
 
     return routine;
 }
 
-void rte_append_token(Routine *routine, Token *tk)
+void rte_append_instr(Routine *routine, Instr in)
 {
-    if (routine->tk_count == routine->tk_capacity) {
-        routine->tk_capacity = routine->tk_capacity == 0 ? TOKENS_INITIAL_CAPACITY : (routine->tk_capacity*2);
+    if (routine->code_count == routine->code_capacity) {
+        routine->code_capacity = routine->code_capacity == 0 ? CODE_INITIAL_CAPACITY : (routine->code_capacity*2);
 
-        routine->tokens = realloc(routine->tokens, routine->tk_capacity*sizeof(*routine->tokens));
+        routine->code = mem_realloc(MEM_SCOPE, routine->code, routine->code_capacity*sizeof(*routine->code));
     }
 
-    routine->tokens[routine->tk_count++] = tk;
+    routine->code[routine->code_count++] = in;
 }
 
-void rte_execute(Routine *routine, Stack *mem, GScope *gscope)
+int rte_search_slot(Routine *routine, char *id)
 {
-    const size_t tk_count = routine->tk_count;
+    for (size_t k = 0; k < routine->slot_count; ++k) {
+        if (strcmp(id, routine->slot_ids[k]) == 0) return k;
+    }
+    return -1;
+}
+
+size_t rte_declare_slot(Routine *routine, char *id)
+{
+    // declaring the same local twice reuses its slot
+    int k = rte_search_slot(routine, id);
+    if (k != -1) return k;
+
+    if (routine->slot_count == routine->slot_capacity) {
+        routine->slot_capacity = routine->slot_capacity == 0 ? 4 : (routine->slot_capacity*2);
+        routine->slot_ids = mem_realloc(MEM_SCOPE, routine->slot_ids, routine->slot_capacity*sizeof(*routine->slot_ids));
+    }
+
+    routine->slot_ids[routine->slot_count] = mem_strdup(MEM_SCOPE, id);
+    return routine->slot_count++;
+}
 
-    for (size_t i = 0; i < tk_count; ++i) {
-        Token *tk = routine->tokens[i];
+FrameStack *frames_create(const size_t initial_capacity)
+{
+    FrameStack *frames = mem_alloc(MEM_STACK, sizeof(FrameStack));
+    frames->count = 0;
+    frames->capacity = initial_capacity;
+    frames->slots = mem_calloc(MEM_STACK, initial_capacity, sizeof(*frames->slots));
+    return frames;
+}
+
+void frames_destroy(FrameStack *frames)
+{
+    assert(frames->count == 0);
+    mem_free(frames->slots);
+    mem_free(frames);
+}
+
+void frames_reserve(FrameStack *frames, size_t count)
+{
+    while (frames->count + count > frames->capacity) {
+        frames->capacity = frames->capacity == 0 ? 64 : (frames->capacity*2);
+        frames->slots = mem_realloc(MEM_STACK, frames->slots, frames->capacity*sizeof(*frames->slots));
+    }
+}
+
+size_t frames_enter(FrameStack *frames, Routine *routine, Stack *mem)
+{
+    // open the frame of a call and move the arguments from the data stack
+    // into the parameter slots, the deepest argument is the first parameter
+    size_t base = frames->count;
+    if (routine->slot_count == 0) return base;
+
+    if (mem->count < routine->param_count) {
+        fprintf(stderr, ERR_PREFIX"Routine '%s' expects %zu arguments, found %zu on the stack\n",
+                ERR_EXP, routine->id, routine->param_count, mem->count);
+        exit(EXIT_FAILURE);
+    }
+
+    frames_reserve(frames, routine->slot_count);
+    Value **slots = frames->slots + base;
+    mem->count -= routine->param_count;
+    memcpy(slots, mem->items + mem->count, routine->param_count*sizeof(*slots));
+    memset(slots + routine->param_count, 0, (routine->slot_count - routine->param_count)*sizeof(*slots));
+
+    frames->count += routine->slot_count;
+    return base;
+}
+
+void frames_leave(FrameStack *frames, size_t base)
+{
+    while (frames->count > base) {
+        Value *value = frames->slots[--frames->count];
+        if (value != NULL) value_unref(value);
+    }
+}
+
+void rte_resolve_branches(Module *mod, Routine *routine)
+{
+    // match every if with its else/then and store the relative offset of the
+    // target in the instruction, so that executing a branch is a single jump
+    size_t *open = mem_alloc(MEM_SCOPE, sizeof(*open)*(routine->code_count+1));
+    size_t open_count = 0;
 
-        switch (tk->ttype) {
+    for (size_t i = 0; i < routine->code_count; ++i) {
+        Instr *in = &routine->code[i];
+        Location loc = mod_loc(mod, in->src);
+
+        switch (in->op) {
+            case KW_IF: open[open_count++] = i;
+                break;
+
+            case KW_ELSE: {
+                if (open_count == 0 || routine->code[open[open_count-1]].op != KW_IF) {
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: 'else' without matching 'if' in routine '%s'\n",
+                            ERR_EXP, loc.row, loc.col, routine->id);
+                    exit(EXIT_FAILURE);
+                }
+
+                // false condition resumes right after else
+                size_t j = open[open_count-1];
+                routine->code[j].arg = i - j;
+                open[open_count-1] = i;
+            } break;
+
+            case KW_THEN: {
+                if (open_count == 0) {
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: 'then' without matching 'if' in routine '%s'\n",
+                            ERR_EXP, loc.row, loc.col, routine->id);
+                    exit(EXIT_FAILURE);
+                }
+
+                size_t j = open[--open_count];
+                routine->code[j].arg = i - j;
+            } break;
+
+            default: break;
+        }
+    }
+
+    if (open_count != 0) {
+        Instr *in = &routine->code[open[open_count-1]];
+        Location loc = mod_loc(mod, in->src);
+        fprintf(stderr, ERR_PREFIX"%zu:%zu: '%s' is never closed by 'then' in routine '%s'\n",
+                ERR_EXP, loc.row, loc.col, mod_txt(mod, in->src), routine->id);
+        exit(EXIT_FAILURE);
+    }
+
+    mem_free(open);
+}
+
+bool rte_compare(Value *a, Value *b, TokenType op)
+{
+    // a is the deeper value, so "a b <" reads as a < b
+    int cmp = 0;
+
+    if (a->type == VT_INT && b->type == VT_INT) {
+        cmp = (a->integer > b->integer) - (a->integer < b->integer);
+    } else if (value_is_number(a) && value_is_number(b)) {
+        double x = value_as_real(a);
+        double y = value_as_real(b);
+        cmp = (x > y) - (x < y);
+    } else if (a->type == VT_STRING && b->type == VT_STRING) {
+        // strings may be views, the shorter one wins a tie
+        int order = memcmp(a->txt, b->txt, a->len < b->len ? a->len : b->len);
+        cmp = order != 0 ? order : (a->len > b->len) - (a->len < b->len);
+    } else if (a->type == VT_BOOL && b->type == VT_BOOL) {
+        cmp = a->boolean - b->boolean;
+    } else if (a->type == b->type && (op == OP_EQ || op == OP_NEQ) &&
+               (a->type == VT_ARRAY || a->type == VT_TABLE || a->type == VT_TASK)) {
+        // equal when they are the same array, table or task, contents aren't compared
+        const void *x = a->type == VT_ARRAY ? (void *) a->array : a->type == VT_TABLE ? (void *) a->table : (void *) a->task;
+        const void *y = b->type == VT_ARRAY ? (void *) b->array : b->type == VT_TABLE ? (void *) b->table : (void *) b->task;
+        cmp = x != y;
+    } else if (op == OP_EQ || op == OP_NEQ) {
+        // values of different types are never equal
+        return op == OP_NEQ;
+    } else {
+        fprintf(stderr, ERR_PREFIX"Can't compare %s with %s\n", ERR_EXP, vtype_tostr(a->type), vtype_tostr(b->type));
+        exit(EXIT_FAILURE);
+    }
+
+    switch (op) {
+        case OP_EQ: return cmp == 0;
+        case OP_NEQ: return cmp != 0;
+        case OP_GT: return cmp > 0;
+        case OP_GTE: return cmp >= 0;
+        case OP_LT: return cmp < 0;
+        case OP_LTE: return cmp <= 0;
+        default:
+            assert(0 && "Unreachable");
+            return false;
+    }
+}
+
+void rte_divide_error(void)
+{
+    // rte_run reports it with the location before getting here
+    fprintf(stderr, ERR_PREFIX"Can't divide by zero\n", ERR_EXP);
+    exit(EXIT_FAILURE);
+}
+
+Value *rte_arithmetic(Value *a, Value *b, TokenType op)
+{
+    // a is the deeper value, so "7 5 -" reads as 7 - 5
+    if (a->type == VT_INT && b->type == VT_INT) {
+        long x = a->integer;
+        long y = b->integer;
+
+        // results that don't fit a long become float, like inexact divisions
+        long z;
+        switch (op) {
+            case OP_SUM:
+                if (__builtin_add_overflow(x, y, &z)) return value_create_float((double) x + y);
+                return value_create_int(z);
+            case OP_SUB:
+                if (__builtin_sub_overflow(x, y, &z)) return value_create_float((double) x - y);
+                return value_create_int(z);
+            case OP_MUL:
+                if (__builtin_mul_overflow(x, y, &z)) return value_create_float((double) x * y);
+                return value_create_int(z);
+            case OP_DIV: {
+                if (y == 0) rte_divide_error();
+                if (y == -1 && x == LONG_MIN) return value_create_float(-(double) x);
+                if (x % y == 0) return value_create_int(x / y);
+                return value_create_float((double) x / y);
+            }
+            case OP_MOD: {
+                if (y == 0) rte_divide_error();
+                if (y == -1) return value_create_int(0);
+                return value_create_int(x % y);
+            }
+            default:
+                assert(0 && "Unreachable");
+                return NULL;
+        }
+    }
+
+    double x = value_as_real(a);
+    double y = value_as_real(b);
+    double numeric_result = 0;
+
+    switch (op) {
+        case OP_SUM: numeric_result = x + y;
+            break;
+        case OP_SUB: numeric_result = x - y;
+            break;
+        case OP_MUL: numeric_result = x * y;
+            break;
+        case OP_DIV: {
+            if (y == 0) rte_divide_error();
+            numeric_result = x / y;
+        } break;
+        case OP_MOD: numeric_result = fmod(x, y);
+            break;
+        default:
+            assert(0 && "Unreachable");
+            break;
+    }
+
+    // if result its essentially an int then convert it
+    double intpart;
+    if (modf(numeric_result, &intpart) == 0 && fabs(intpart) < 9.2e18)
+        return value_create_int((long) intpart);
+
+    return value_create_float(numeric_result);
+}
+
+Value *rte_fold(Value *a, Value *b, TokenType op)
+{
+    // result of "a b op" when it can be computed at compile time, NULL for
+    // operations that must fail (or may fail) when executed
+    switch (op) {
+        case OP_SUM:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD: {
+            if (!value_is_number(a) || !value_is_number(b)) return NULL;
+            if ((op == OP_DIV || op == OP_MOD) && value_as_real(b) == 0) return NULL;
+            return rte_arithmetic(a, b, op);
+        }
+
+        case OP_EQ:
+        case OP_NEQ:
+        case OP_GT:
+        case OP_GTE:
+        case OP_LT:
+        case OP_LTE: {
+            bool comparable = a->type == b->type || (value_is_number(a) && value_is_number(b));
+            if (!comparable && op != OP_EQ && op != OP_NEQ) return NULL;
+            return value_create_bool(rte_compare(a, b, op));
+        }
+
+        default: return NULL;
+    }
+}
+
+void rte_fold_constants(GScope *gscope, Routine *routine)
+{
+    // replace "const const op" with the constant result, folding again as
+    // long as the tail of the routine reduces. Branch keywords are never
+    // folded, so offsets computed afterwards stay valid
+    Instr *code = routine->code;
+    size_t n = 0;
+
+    for (size_t i = 0; i < routine->code_count; ++i) {
+        code[n++] = code[i];
+
+        while (n >= 3 && code[n-2].op == CONST_LOAD && code[n-3].op == CONST_LOAD) {
+            Value *result = rte_fold(gscope->constants[code[n-3].arg],
+                                     gscope->constants[code[n-2].arg], code[n-1].op);
+            if (result == NULL) break;
+
+            // the folded constant is located at its first operand
+            n -= 2;
+            code[n-1].arg = gscope_append_constant(gscope, result);
+        }
+    }
+
+    routine->code_count = n;
+}
+
+Instr rte_make_constant(GScope *gscope, size_t src)
+{
+    // literals are parsed once into the pool, strings with a new line escape
+    // and every other token are lowered as they are
+    Module *mod = gscope->mod;
+    TokenType ttype = mod_type(mod, src);
+    ValueType vtype = VT_UNKNOWN;
+
+    switch (ttype) {
+        case LIT_STRING: {
+            if (strstr(mod_txt(mod, src), "\\n") == NULL) vtype = VT_STRING;
+        } break;
+        case LIT_INT: vtype = VT_INT;
+            break;
+        case LIT_FLOAT: vtype = VT_FLOAT;
+            break;
+        case LIT_BOOL: vtype = VT_BOOL;
+            break;
+        default: break;
+    }
+
+    if (vtype == VT_UNKNOWN) return (Instr) {ttype, src, 0};
+    return (Instr) {CONST_LOAD, src, gscope_append_constant(gscope, value_create(mod_txt(mod, src), vtype))};
+}
+
+void rte_resolve_symbols(GScope *gscope, Routine *routine)
+{
+    // lower the tokens of routine into code, invocations become calls, loads
+    // and stores by index, so executing them never looks up a name. "name ="
+    // becomes a single store and "@name literal" declares a local initialized
+    // when execution reaches it. Parameters and locals shadow routines and globals
+    Module *mod = gscope->mod;
+    const size_t end = routine->src_start + routine->src_count;
+
+    for (size_t i = routine->src_start; i < end; ++i) {
+        TokenType ttype = mod_type(mod, i);
+        char *txt = mod_txt(mod, i);
+        Location loc = mod_loc(mod, i);
+
+        if (ttype == OP_BIND) {
+            fprintf(stderr, ERR_PREFIX"%zu:%zu: nothing to bind in routine '%s'\n",
+                    ERR_EXP, loc.row, loc.col, routine->id);
+            exit(EXIT_FAILURE);
+        }
+
+        if (ttype == VAR_SYM) continue;
+
+        if (ttype == ID_VAR) {
+            TokenType value = i+1 < end ? mod_type(mod, i+1) : UNKNOWN;
+            if (!(value == LIT_INT || value == LIT_FLOAT || value == LIT_STRING || value == LIT_BOOL)) {
+                fprintf(stderr, ERR_PREFIX"%zu:%zu: local '%s' must be initialized with a literal\n",
+                        ERR_EXP, loc.row, loc.col, txt);
+                exit(EXIT_FAILURE);
+            }
+
+            long slot = rte_declare_slot(routine, txt);
+            rte_append_instr(routine, rte_make_constant(gscope, i+1));
+            rte_append_instr(routine, (Instr) {LOCAL_STORE, i, slot});
+            i++;
+            continue;
+        }
+
+        if (ttype == KW_SPAWN || ttype == KW_MAP || ttype == KW_REDUCE || ttype == KW_EACH_LINE) {
+            // "n spawn name", "map name", the name is part of the instruction
+            int rte_j = i+1 < end && mod_type(mod, i+1) == ID_INVOCATION ? gscope_search_routine(gscope, mod_txt(mod, i+1)) : -1;
+            if (rte_j == -1) {
+                fprintf(stderr, ERR_PREFIX"%zu:%zu: '%s' must be followed by the name of a routine in routine '%s'\n",
+                        ERR_EXP, loc.row, loc.col, txt, routine->id);
+                exit(EXIT_FAILURE);
+            }
+
+            rte_append_instr(routine, (Instr) {ttype, i, rte_j});
+            i++;
+            continue;
+        }
+
+        if (ttype != ID_INVOCATION) {
+            rte_append_instr(routine, rte_make_constant(gscope, i));
+            continue;
+        }
+
+        int slot = rte_search_slot(routine, txt);
+
+        if (i+1 < end && mod_type(mod, i+1) == OP_BIND) {
+            int var_j = gscope_search_variable(gscope, txt);
+            if (slot != -1) {
+                rte_append_instr(routine, (Instr) {LOCAL_STORE, i, slot});
+            } else if (var_j == -1) {
+                fprintf(stderr, ERR_PREFIX"Variable has not been declared: '%s'\n", ERR_EXP, txt);
+                exit(EXIT_FAILURE);
+            } else {
+                rte_append_instr(routine, (Instr) {VAR_STORE, i, var_j});
+            }
+            i++;
+
+        } else {
+            int rte_j = gscope_search_routine(gscope, txt);
+            int var_j = gscope_search_variable(gscope, txt);
+
+            if (slot != -1) {
+                rte_append_instr(routine, (Instr) {LOCAL_LOAD, i, slot});
+            } else if (rte_j != -1) {
+                rte_append_instr(routine, (Instr) {RTE_CALL, i, rte_j});
+            } else if (var_j != -1 && !gscope->variables[var_j]->rebound) {
+                Variable *variable = gscope->variables[var_j];
+                if (variable->constant == -1)
+                    variable->constant = gscope_append_constant(gscope, value_ref(variable->value));
+
+                rte_append_instr(routine, (Instr) {CONST_LOAD, i, variable->constant});
+            } else if (var_j != -1) {
+                rte_append_instr(routine, (Instr) {VAR_LOAD, i, var_j});
+            } else {
+                fprintf(stderr, ERR_PREFIX"Symbol has not been declared: '%s'\n", ERR_EXP, txt);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+size_t rte_body_count(Module *mod, Routine *routine)
+{
+    // trailing end is not part of the body, routines not compiled yet are
+    // measured on their tokens
+    if (routine->state != COMPILE_DONE) {
+        size_t body_count = routine->src_count;
+        if (body_count > 0 && mod_type(mod, routine->src_start + body_count-1) == KW_END) body_count--;
+        return body_count;
+    }
+
+    size_t body_count = routine->code_count;
+    if (body_count > 0 && routine->code[body_count-1].op == KW_END) body_count--;
+    return body_count;
+}
+
+void rte_compile(GScope *gscope, Routine *routine)
+{
+    // resolve symbols, splice the bodies of small non recursive callees in
+    // place of their calls, fold constants and compute branch offsets. Callees that may be
+    // inlined are compiled first (depth first), the others wait for their
+    // own first call or for gscope_compile_routines
+    assert(routine->state == COMPILE_PENDING);
+    routine->state = COMPILE_ACTIVE;
+
+    rte_resolve_symbols(gscope, routine);
+
+    if (gscope->inline_threshold > 0) {
+        Instr *code = routine->code;
+        size_t code_count = routine->code_count;
+
+        routine->code = NULL;
+        routine->code_count = 0;
+        routine->code_capacity = 0;
+
+        for (size_t i = 0; i < code_count; ++i) {
+            Instr in = code[i];
+            Routine *callee = in.op == RTE_CALL ? gscope->routines[in.arg] : NULL;
+
+            if (callee != NULL && callee->state == COMPILE_ACTIVE) {
+                // invocation closes a cycle, keep it as a call
+                routine->recursive = true;
+                callee = NULL;
+            }
+
+            // resolving only shrinks a body, too big callees stay uncompiled
+            if (callee != NULL && callee->state == COMPILE_PENDING && rte_body_count(gscope->mod, callee) <= gscope->inline_threshold)
+                rte_compile(gscope, callee);
+
+            // callees with a frame need a real call to open it
+            if (callee != NULL && callee->state == COMPILE_DONE && !callee->recursive && callee->slot_count == 0) {
+                size_t body_count = rte_body_count(gscope->mod, callee);
+
+                if (body_count <= gscope->inline_threshold) {
+                    for (size_t k = 0; k < body_count; ++k)
+                        rte_append_instr(routine, callee->code[k]);
+                    continue;
+                }
+            }
+
+            rte_append_instr(routine, in);
+        }
+
+        mem_free(code);
+    }
+
+    rte_fold_constants(gscope, routine);
+    rte_resolve_branches(gscope->mod, routine);
+    routine->state = COMPILE_DONE;
+}
+
+// Top of stack caching: while a routine runs, the top of the data stack is
+// kept in the local tos instead of mem->items, so a sequence like "7 5 +"
+// mostly works on a register. Stack holds everything below tos and gets the
+// cached value back (a spill) before calls, the tracer and .mem. Build with
+// -DNO_TOS_CACHE to access the Stack directly for every operation
+
+#ifndef NO_TOS_CACHE
+
+#define TOS_DEPTH() (mem->count + (tos != NULL))
+
+// TOS_TOP and TOS_NEXT are valid after TOS_LOAD
+#define TOS_LOAD()                                                          \
+do {                                                                        \
+    if (tos == NULL) tos = mem->items[--mem->count];                        \
+} while (0)
+
+#define TOS_TOP() (tos)
+#define TOS_NEXT() (mem->items[mem->count-1])
+
+#define TOS_PUSH(value)                                                     \
+do {                                                                        \
+    Value *pushed_ = (value);                                               \
+    if (tos != NULL) st_push(mem, tos);                                     \
+    tos = pushed_;                                                          \
+} while (0)
+
+#define TOS_POP()                                                           \
+do {                                                                        \
+    TOS_LOAD();                                                             \
+    value_unref(tos);                                                       \
+    tos = NULL;                                                             \
+} while (0)
+
+#define TOS_SWAP()                                                          \
+do {                                                                        \
+    TOS_LOAD();                                                             \
+    Value *next_ = mem->items[mem->count-1];                                \
+    mem->items[mem->count-1] = tos;                                         \
+    tos = next_;                                                            \
+} while (0)
+
+#define TOS_SPILL()                                                         \
+do {                                                                        \
+    if (tos != NULL) st_push(mem, tos);                                     \
+    tos = NULL;                                                             \
+} while (0)
+
+#else
+
+#define TOS_DEPTH() (mem->count)
+#define TOS_LOAD() do {} while (0)
+#define TOS_TOP() st_peek(mem, 0)
+#define TOS_NEXT() st_peek(mem, 1)
+#define TOS_PUSH(value) st_push(mem, (value))
+#define TOS_POP() st_pop(mem)
+#define TOS_SWAP() st_swap(mem)
+#define TOS_SPILL() do {} while (0)
+
+#endif // NO_TOS_CACHE
+
+// stack underflows are errors of the program, not of the interpreter, so a
+// trap (library, daemon) can recover from them
+#define TOS_EXPECT(n)                                                       \
+do {                                                                        \
+    if (__builtin_expect(TOS_DEPTH() < (n), 0))                             \
+        rte_underflow(gscope, routine, in, (n), TOS_DEPTH());               \
+} while (0)
+
+void rte_underflow(GScope *gscope, Routine *routine, const Instr *in, size_t expected, size_t found)
+{
+    Location loc = mod_loc(gscope->mod, in->src);
+    fprintf(stderr, ERR_PREFIX"%zu:%zu: stack underflow on '%s', %zu needed and %zu found in routine '%s'\n",
+            ERR_EXP, loc.row, loc.col, mod_txt(gscope->mod, in->src), expected, found, routine->id);
+    exit(EXIT_FAILURE);
+}
+
+void rte_type_error(GScope *gscope, const Instr *in, const char *expected, Value *found)
+{
+    Location loc = mod_loc(gscope->mod, in->src);
+    fprintf(stderr, ERR_PREFIX"%zu:%zu: '%s' expects %s, found %s\n",
+            ERR_EXP, loc.row, loc.col, mod_txt(gscope->mod, in->src), expected, vtype_tostr(found->type));
+    exit(EXIT_FAILURE);
+}
+
+size_t rte_count_operand(GScope *gscope, const Instr *in, Value *value)
+{
+    if (value->type != VT_INT || value->integer < 0) rte_type_error(gscope, in, "a count", value);
+    return (size_t) value->integer;
+}
+
+bool rte_is_text(Value *value)
+{
+    // what concat turns into text
+    return value->type == VT_STRING || value->type == VT_INT || value->type == VT_FLOAT || value->type == VT_BOOL;
+}
+
+bool rte_is_key(Value *value)
+{
+    return value->type == VT_STRING || value->type == VT_INT;
+}
+
+void rte_execute(Routine *routine, Stack *mem, FrameStack *frames, GScope *gscope);
+
+// defined by tasks.h
+struct Task *task_spawn(GScope *gscope, Routine *routine, Stack *mem, size_t n);
+void task_join(struct Task *task, Stack *mem);
+Value *array_map(GScope *gscope, Routine *routine, Value *array);
+Value *array_reduce(GScope *gscope, Routine *routine, Value *array);
+
+// defined by input.h
+Value *input_read_line(void);
+void input_each_line(GScope *gscope, Routine *routine, Value *path, Stack *mem, FrameStack *frames);
+
+void rte_run(Routine *routine, size_t start, size_t base, Stack *mem, FrameStack *frames, GScope *gscope)
+{
+    // execute the code of routine from start on, its frame is already open
+    // at base. Slots are addressed from base, nested calls may move frames->slots
+    const size_t code_count = routine->code_count;
+    const Instr *code = routine->code;
+#ifndef NO_TOS_CACHE
+    Value *tos = NULL;
+#endif
+
+    for (size_t i = start; i < code_count; ++i) {
+        const Instr *in = &code[i];
+        if (__builtin_expect(tracer.enabled, 0)) {
+            // the tracer reads depth and top from the Stack
+            TOS_SPILL();
+            trace_record(routine->index, in->src, in->op, mem);
+        }
+
+        switch (in->op) {
             case LIT_STRING: {
+                char *txt = mod_txt(gscope->mod, in->src);
 
                 // check if string contains new line characters
                 size_t c = 0;
-                size_t string_len = strlen(tk->txt);
+                size_t string_len = strlen(txt);
 
                 // stored strings treat \n as two different chars
                 while (c < string_len) {
-                    if (tk->txt[c] == '\\' && tk->txt[c+1] == 'n') {
+                    if (txt[c] == '\\' && txt[c+1] == 'n') {
                         // can't use new line escape char inside string
                         fprintf(stderr, "ERROR: can't use new line escape char inside string\n");
                         exit(EXIT_FAILURE);
@@ -137,20 +942,20 @@ void rte_execute(Routine *routine, Stack *mem, GScope *gscope)
                 }
 
                 // everything is ok
-                st_push(mem, value_create(tk->txt, VT_STRING));
+                TOS_PUSH(value_create_string(txt));
 
             } break;
 
             case LIT_FLOAT: {
-                st_push(mem, value_create(tk->txt, VT_FLOAT));
+                TOS_PUSH(value_create(mod_txt(gscope->mod, in->src), VT_FLOAT));
             } break;
 
             case LIT_INT: {
-                st_push(mem, value_create(tk->txt, VT_INT));
+                TOS_PUSH(value_create(mod_txt(gscope->mod, in->src), VT_INT));
             } break;
 
             case LIT_BOOL: {
-                st_push(mem, value_create(tk->txt, VT_BOOL));
+                TOS_PUSH(value_create(mod_txt(gscope->mod, in->src), VT_BOOL));
             } break;
 
             case OP_SUM: 
@@ -160,199 +965,460 @@ void rte_execute(Routine *routine, Stack *mem, GScope *gscope)
             case OP_MOD: {
 
                 // stack should contains at least two numbers
-                assert(mem->count >= 2);
+                TOS_EXPECT(2);
+
+                TOS_LOAD();
+                Value *a = TOS_NEXT();
+                Value *b = TOS_TOP();
 
                 // verify is last two items in mem are actually numbers
-                CHECK_LAST_NUMBERS_TYPE(mem, "ERROR: tried to operate on values that are not numbers\n");
-
-                float x, y;
-                RETRIEVE_LAST_NUMBERS_FLOAT(&x, &y, mem);
-
-                char result[16];
-                float numeric_result = 0;
-
-                switch (tk->ttype) {
-                    case OP_SUM: numeric_result = x + y;
-                        break;
-                    case OP_SUB: numeric_result = x - y;
-                        break;
-                    case OP_MUL: numeric_result = x * y;
-                        break;
-                    case OP_DIV: {
-                        assert(y != 0 && "Can't divide by zero");
-                        numeric_result = x / y;
-                    } break;
-                    case OP_MOD: numeric_result = fmod(x, (int) y);
-                        break;
-                    default:
-                        assert(0 && "Unreachable");
-                        break;
+                if (!value_is_number(a) || !value_is_number(b)) {
+                    fprintf(stderr, "ERROR: tried to operate on values that are not numbers\n");
+                    exit(EXIT_FAILURE);
                 }
 
-                // verify if result has a fractional part
-                double fractpart, intpart;
-                fractpart = modf(numeric_result, &intpart);
-                ValueType vtype = VT_FLOAT;
+                // a runtime error, not an abort, daemon and library runs survive it
+                bool int_mod = in->op == OP_MOD && a->type == VT_INT && b->type == VT_INT;
+                if ((in->op == OP_DIV || int_mod) && value_as_real(b) == 0) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: can't divide by zero\n", ERR_EXP, loc.row, loc.col);
 
-                // if result its essentially an int then convert it
-                if (fractpart == 0) {
-                    sprintf(result, "%d", (int) numeric_result);
-                    vtype = VT_INT;
-                } else sprintf(result, "%f", numeric_result);
+                    // the operands stay on the stack of the caller, which releases them
+                    TOS_SPILL();
+                    exit(EXIT_FAILURE);
+                }
 
-                // push result as a string
-                st_push(mem, value_create(result, vtype));
+                Value *result = rte_arithmetic(a, b, in->op);
+                TOS_POP();
+                TOS_POP();
+                TOS_PUSH(result);
 
             } break;
 
-            case KW_CR: printf("\n");
+            case KW_CR: fputc('\n', rte_output());
                 break;
 
             case OP_EMIT: {
-                assert(mem->count >= 1);
-                for (size_t c = 0; st_peek(mem, 0)->txt[c] != '\0'; c++)
-                    assert(isdigit(st_peek(mem, 0)->txt[c]));
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                if (TOS_TOP()->type != VT_INT) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: 'emit' expects an int, found %s\n",
+                            ERR_EXP, loc.row, loc.col, vtype_tostr(TOS_TOP()->type));
+                    exit(EXIT_FAILURE);
+                }
 
-                printf("%c", (char) atoi(st_peek(mem, 0)->txt));
-                st_pop(mem);
+                fputc((char) TOS_TOP()->integer, rte_output());
+                TOS_POP();
             } break;
 
             case OP_PRINT: {
-                assert(mem->count >= 1);
-                printf("%s", st_peek(mem, 0)->txt);
-                st_pop(mem);
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                value_print(TOS_TOP());
+                TOS_POP();
             } break;
 
             case OP_PRINT_MEM: {
                 // assert(mem->count >= 1);
+                TOS_SPILL();
                 st_display(mem);
             } break;
 
             case KW_DUP: {
-                assert(mem->count >= 1);
-                st_push(mem, value_create(st_peek(mem, 0)->txt, st_peek(mem, 0)->type));
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                TOS_PUSH(value_ref(TOS_TOP()));
             } break;
 
             case KW_DROP: {
-                assert(mem->count >= 1);
-                st_pop(mem);
+                TOS_EXPECT(1);
+                TOS_POP();
             } break;
 
             case KW_SWAP: {
-                assert(mem->count >= 2);
-                Value *last = value_create(st_peek(mem, 0)->txt, st_peek(mem, 0)->type);
-                Value *second_last = value_create(st_peek(mem, 1)->txt, st_peek(mem, 1)->type);
-
-                st_pop(mem);
-                st_pop(mem);
-
-                st_push(mem, last);
-                st_push(mem, second_last);
-
+                TOS_EXPECT(2);
+                TOS_SWAP();
             } break;
 
             case KW_OVER: {
-                assert(mem->count >= 2);
-                st_push(mem, value_create(st_peek(mem, 1)->txt, st_peek(mem, 1)->type));
+                TOS_EXPECT(2);
+                TOS_LOAD();
+                TOS_PUSH(value_ref(TOS_NEXT()));
             } break;
 
             case KW_END: {
 
-                if (strcmp(routine->id, "main") == 0) {
-                    // main routine stack should be empty at program end
-                    assert(mem->count == 0);
+                // always the last instruction, rte_execute closes the frame.
+                // main routine stack should be empty at program end
+                if (routine->is_main && TOS_DEPTH() != 0) {
+                    fprintf(stderr, ERR_PREFIX"routine 'main' ends with a stack of depth %zu, it should be empty\n",
+                            ERR_EXP, (size_t) TOS_DEPTH());
+                    exit(EXIT_FAILURE);
                 }
+            } break;
+
+            case VAR_STORE: {
+                TOS_EXPECT(1);
 
-                // TODO: should do something
+                // share the value with the stack, then release the old one
+                TOS_LOAD();
+                var_set(gscope->variables[in->arg], value_ref(TOS_TOP()));
+                TOS_POP();
             } break;
 
-            case OP_BIND: {
-                assert(routine->tokens[i-1]->ttype == ID_INVOCATION);
+            case CONST_LOAD: {
+                TOS_PUSH(value_ref(gscope->constants[in->arg]));
+            } break;
 
-                Token *token = routine->tokens[i-1];
-                int var_j = gscope_search_variable(gscope, token->txt);
+            case VAR_LOAD: {
+                TOS_PUSH(var_get(gscope->variables[in->arg]));
+            } break;
 
-                if (var_j != -1) {
-                    assert(mem->count >= 1);
+            case RTE_CALL: {
+                Routine *callee = gscope->routines[in->arg];
 
-                    Value *new_value = value_create(st_peek(mem, 0)->txt, st_peek(mem, 0)->type);
+                // lazy mode compiles routines the first time they run
+                if (callee->state != COMPILE_DONE) rte_compile(gscope, callee);
+                TOS_SPILL();
+                rte_execute(callee, mem, frames, gscope);
+            } break;
 
-                    gscope->variables[var_j]->value = new_value;
-                    st_pop(mem);
+            case LOCAL_STORE: {
+                TOS_EXPECT(1);
 
-                } else {
-                    fprintf(stderr, ERR_PREFIX"Variable has not been declared: '%s'\n", ERR_EXP, token->txt);
+                TOS_LOAD();
+                Value **slot = &frames->slots[base + in->arg];
+                Value *old_value = *slot;
+                *slot = value_ref(TOS_TOP());
+                if (old_value != NULL) value_unref(old_value);
+                TOS_POP();
+            } break;
+
+            case LOCAL_LOAD: {
+                Value *value = frames->slots[base + in->arg];
+                if (value == NULL) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: local '%s' used before being assigned\n",
+                            ERR_EXP, loc.row, loc.col, mod_txt(gscope->mod, in->src));
                     exit(EXIT_FAILURE);
                 }
+                TOS_PUSH(value_ref(value));
+            } break;
+
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_GT:
+            case OP_GTE:
+            case OP_LT:
+            case OP_LTE: {
+                TOS_EXPECT(2);
+
+                TOS_LOAD();
+                bool result = rte_compare(TOS_NEXT(), TOS_TOP(), in->op);
+                TOS_POP();
+                TOS_POP();
 
+                TOS_PUSH(value_create_bool(result));
             } break;
 
-            case ID_INVOCATION: {
+            case KW_IF: {
+                TOS_EXPECT(1);
 
-                // search routine in routines list
-                int rte_j = gscope_search_routine(gscope, tk->txt);
-                int var_j = gscope_search_variable(gscope, tk->txt);
+                TOS_LOAD();
+                Value *cond = TOS_TOP();
+                if (cond->type != VT_BOOL) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: 'if' expects a bool, found %s\n",
+                            ERR_EXP, loc.row, loc.col, vtype_tostr(cond->type));
+                    exit(EXIT_FAILURE);
+                }
 
-                // routines has been declared
-                if (rte_j != -1) {
+                bool taken = cond->boolean;
+                TOS_POP();
 
-                    // execute recursively routines
-                    rte_execute(gscope->routines[rte_j], mem, gscope);
+                // jump to else or then, the loop increment skips past it
+                if (!taken) i += in->arg;
+            } break;
 
-                } else if (var_j != -1) {
+            case KW_ELSE: {
+                // end of the taken branch, skip to then
+                i += in->arg;
+            } break;
 
-                    // variable invocation
-                    if (routine->tokens[i+1]->ttype != OP_BIND) {
-                        st_push(mem, gscope->variables[var_j]->value);
-                    }
+            case KW_THEN: break;
+
+            case KW_SPAWN: {
+                // "n spawn name" moves the top n values to the stack of a new
+                // task running name and pushes its handle
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                size_t n = rte_count_operand(gscope, in, TOS_TOP());
+                TOS_POP();
+                TOS_EXPECT(n);
+                TOS_SPILL();
+                TOS_PUSH(value_create_task(task_spawn(gscope, gscope->routines[in->arg], mem, n)));
+            } break;
 
-                } else {
-                    if (routine->tokens[i+1]->ttype == OP_BIND) {
-                        fprintf(stderr, ERR_PREFIX"Variable has not been declared: '%s'\n", ERR_EXP, tk->txt);
-                    } else fprintf(stderr, ERR_PREFIX"Symbol has not been declared: '%s'\n", ERR_EXP, tk->txt);
+            case KW_JOIN: {
+                // waits for the task and pushes the values it left on its stack
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                Value *handle = TOS_TOP();
+                if (handle->type != VT_TASK) rte_type_error(gscope, in, "a task", handle);
+
+                value_ref(handle);
+                TOS_POP();
+                TOS_SPILL();
+                task_join(handle->task, mem);
+                value_unref(handle);
+            } break;
+
+            case KW_PACK: {
+                // "a b c 3 pack" moves the top 3 values into the array {a, b, c}
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                size_t n = rte_count_operand(gscope, in, TOS_TOP());
+                TOS_POP();
+                TOS_EXPECT(n);
+                TOS_SPILL();
+
+                Value *array = value_create_array(n);
+                mem->count -= n;
+                memcpy(array->array->items, mem->items + mem->count, n*sizeof(*mem->items));
+                TOS_PUSH(array);
+            } break;
+
+            case KW_UNPACK: {
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                Value *array = TOS_TOP();
+                if (array->type != VT_ARRAY) rte_type_error(gscope, in, "an array", array);
+
+                value_ref(array);
+                TOS_POP();
+                for (size_t k = 0; k < array->array->count; ++k)
+                    TOS_PUSH(value_ref(array->array->items[k]));
+                value_unref(array);
+            } break;
+
+            case KW_RANGE: {
+                // "n range" is {0, 1, ..., n-1}
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                size_t n = rte_count_operand(gscope, in, TOS_TOP());
+                TOS_POP();
+
+                Value *array = value_create_array(n);
+                for (size_t k = 0; k < n; ++k)
+                    array->array->items[k] = value_create_int((long) k);
+                TOS_PUSH(array);
+            } break;
+
+            case KW_LEN: {
+                // items of an array, bytes of a string, keys of a table
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                Value *value = TOS_TOP();
+                long count = 0;
+                if (value->type == VT_ARRAY) count = (long) value->array->count;
+                else if (value->type == VT_STRING) count = (long) value->len;
+                else if (value->type == VT_TABLE) count = (long) table_count(value->table);
+                else rte_type_error(gscope, in, "an array, a string or a table", value);
+
+                Value *len = value_create_int(count);
+                TOS_POP();
+                TOS_PUSH(len);
+            } break;
+
+            case KW_CONCAT: {
+                TOS_EXPECT(2);
+                TOS_LOAD();
+                if (!rte_is_text(TOS_NEXT())) rte_type_error(gscope, in, "a string or a number", TOS_NEXT());
+                if (!rte_is_text(TOS_TOP())) rte_type_error(gscope, in, "a string or a number", TOS_TOP());
+
+                Value *result = string_concat(TOS_NEXT(), TOS_TOP());
+                TOS_POP();
+                TOS_POP();
+                TOS_PUSH(result);
+            } break;
+
+            case KW_SLICE: {
+                // "s start count slice", the bytes are not copied
+                TOS_EXPECT(3);
+                TOS_LOAD();
+                size_t count = rte_count_operand(gscope, in, TOS_TOP());
+                TOS_POP();
+                TOS_LOAD();
+                size_t start = rte_count_operand(gscope, in, TOS_TOP());
+                TOS_POP();
+                TOS_LOAD();
+                Value *string = TOS_TOP();
+                if (string->type != VT_STRING) rte_type_error(gscope, in, "a string", string);
+                if (start > string->len || count > string->len - start) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: can't slice %zu bytes from %zu of a string of %u bytes\n",
+                            ERR_EXP, loc.row, loc.col, count, start, string->len);
                     exit(EXIT_FAILURE);
                 }
 
+                Value *result = string_slice(string, start, count);
+                TOS_POP();
+                TOS_PUSH(result);
             } break;
 
-            case OP_EQ: {
-                assert(0 && "Equals not implemented yet");
+            case KW_FIND: {
+                // "s needle find" is the offset of needle in s, -1 if missing
+                TOS_EXPECT(2);
+                TOS_LOAD();
+                if (TOS_NEXT()->type != VT_STRING) rte_type_error(gscope, in, "a string", TOS_NEXT());
+                if (TOS_TOP()->type != VT_STRING) rte_type_error(gscope, in, "a string", TOS_TOP());
+
+                Value *result = value_create_int(string_find(TOS_NEXT(), TOS_TOP()));
+                TOS_POP();
+                TOS_POP();
+                TOS_PUSH(result);
             } break;
 
-            case ID_ROUTINE: {
+            case KW_MAP:
+            case KW_REDUCE: {
+                // the routine runs on every item, in parallel chunks
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                Value *array = TOS_TOP();
+                if (array->type != VT_ARRAY) rte_type_error(gscope, in, "an array", array);
+                if (in->op == KW_REDUCE && array->array->count == 0) {
+                    Location loc = mod_loc(gscope->mod, in->src);
+                    fprintf(stderr, ERR_PREFIX"%zu:%zu: can't reduce an empty array\n", ERR_EXP, loc.row, loc.col);
+                    exit(EXIT_FAILURE);
+                }
+
+                Routine *callee = gscope->routines[in->arg];
+                Value *result = in->op == KW_MAP ? array_map(gscope, callee, array) : array_reduce(gscope, callee, array);
+                TOS_POP();
+                TOS_PUSH(result);
+            } break;
 
-                assert(0 && "Can't define routine inside routines");
+            case KW_TABLE: {
+                TOS_PUSH(value_create_table());
+            } break;
 
+            case KW_INSERT: {
+                // "t key value insert" leaves t, with value bound to key
+                TOS_EXPECT(3);
+                TOS_LOAD();
+                Value *value = value_ref(TOS_TOP());
+                TOS_POP();
+                TOS_LOAD();
+                Value *key = TOS_TOP();
+                if (!rte_is_key(key)) rte_type_error(gscope, in, "a string or int key", key);
+                value_ref(key);
+                TOS_POP();
+                TOS_LOAD();
+                if (TOS_TOP()->type != VT_TABLE) rte_type_error(gscope, in, "a table", TOS_TOP());
+
+                table_insert(TOS_TOP()->table, key, value);
             } break;
 
-            case ID_VAR: {
+            case KW_REMOVE: {
+                // "t key remove" leaves t
+                TOS_EXPECT(2);
+                TOS_LOAD();
+                if (!rte_is_key(TOS_TOP())) rte_type_error(gscope, in, "a string or int key", TOS_TOP());
+                if (TOS_NEXT()->type != VT_TABLE) rte_type_error(gscope, in, "a table", TOS_NEXT());
+
+                table_remove(TOS_NEXT()->table, TOS_TOP());
+                TOS_POP();
+            } break;
 
-                assert(0 && "Can't define var inside routines");
+            case KW_GET:
+            case KW_CONTAINS: {
+                // "t key get" pushes the value and true, or only false when
+                // missing, "t key contains" only the bool
+                TOS_EXPECT(2);
+                TOS_LOAD();
+                if (!rte_is_key(TOS_TOP())) rte_type_error(gscope, in, "a string or int key", TOS_TOP());
+                if (TOS_NEXT()->type != VT_TABLE) rte_type_error(gscope, in, "a table", TOS_NEXT());
+
+                Value *value = NULL;
+                bool found;
+                if (in->op == KW_GET) found = (value = table_get(TOS_NEXT()->table, TOS_TOP())) != NULL;
+                else found = table_contains(TOS_NEXT()->table, TOS_TOP());
+
+                TOS_POP();
+                TOS_POP();
+                if (value != NULL) TOS_PUSH(value);
+                TOS_PUSH(value_create_bool(found));
+            } break;
+
+            case KW_READ_LINE: {
+                // pushes the next line of stdin and true, or only false at the end
+                Value *line = input_read_line();
+                if (line != NULL) TOS_PUSH(line);
+                TOS_PUSH(value_create_bool(line != NULL));
+            } break;
 
+            case KW_EACH_LINE: {
+                // "path each-line name" calls name on every line of the file,
+                // "-" is stdin
+                TOS_EXPECT(1);
+                TOS_LOAD();
+                Value *path = TOS_TOP();
+                if (path->type != VT_STRING) rte_type_error(gscope, in, "a path", path);
+
+                value_ref(path);
+                TOS_POP();
+                TOS_SPILL();
+                input_each_line(gscope, gscope->routines[in->arg], path, mem, frames);
+            } break;
+
+            case ID_ROUTINE: {
+                fprintf(stderr, ERR_PREFIX"Can't define routine inside routines: '%s'\n", ERR_EXP, mod_txt(gscope->mod, in->src));
+                exit(EXIT_FAILURE);
+            } break;
+
+            case ID_VAR: {
+                fprintf(stderr, ERR_PREFIX"Can't define var inside routines: '%s'\n", ERR_EXP, mod_txt(gscope->mod, in->src));
+                exit(EXIT_FAILURE);
             } break;
 
             default: {
-                fprintf(stderr, ERR_PREFIX"Can't interpret this token: '%s'\n", ERR_EXP, tk->txt);
-                assert(0);
-                // exit(EXIT_FAILURE);
+                fprintf(stderr, ERR_PREFIX"Can't interpret this token: '%s'\n", ERR_EXP, mod_txt(gscope->mod, in->src));
+                exit(EXIT_FAILURE);
             } break;
         }
     }
+
+    // callers find the results on the Stack
+    TOS_SPILL();
+}
+
+void rte_execute(Routine *routine, Stack *mem, FrameStack *frames, GScope *gscope)
+{
+    PROFILE_ENTER(routine->index);
+
+    size_t base = frames_enter(frames, routine, mem);
+    rte_run(routine, 0, base, mem, frames, gscope);
+    frames_leave(frames, base);
+
+    PROFILE_LEAVE();
 }
 
 void rte_destroy(Routine *routine)
 {
-    for (size_t i = 0; i < routine->tk_count; ++i) {
-        tk_destroy(routine->tokens[i]);
+    for (size_t k = 0; k < routine->slot_count; ++k) {
+        mem_free(routine->slot_ids[k]);
     }
 
-    free(routine->tokens);
-    free(routine);
+    mem_free(routine->slot_ids);
+    mem_free(routine->code);
+    mem_free(routine->id);
+    mem_free(routine);
 }
 
 GScope *gscope_create(const size_t rte_initial_capacity, const size_t var_initial_capacity)
 {
-    GScope *gscope = malloc(sizeof(GScope));
+    GScope *gscope = mem_alloc(MEM_SCOPE, sizeof(GScope));
 
     gscope->rte_count = 0;
     gscope->var_count = 0;
@@ -360,8 +1426,19 @@ GScope *gscope_create(const size_t rte_initial_capacity, const size_t var_initia
     gscope->rte_capacity = rte_initial_capacity;
     gscope->var_capacity = var_initial_capacity;
 
-    gscope->routines = calloc(rte_initial_capacity, sizeof(*gscope->routines));
-    gscope->variables = calloc(rte_initial_capacity, sizeof(*gscope->variables));
+    gscope->routines = mem_calloc(MEM_SCOPE, rte_initial_capacity, sizeof(*gscope->routines));
+    gscope->variables = mem_calloc(MEM_SCOPE, var_initial_capacity, sizeof(*gscope->variables));
+
+    gscope->rte_symbols = (SymbolIndex) {0};
+    gscope->var_symbols = (SymbolIndex) {0};
+
+    gscope->constants = NULL;
+    gscope->const_count = 0;
+    gscope->const_capacity = 0;
+    gscope->inline_threshold = INLINE_DEFAULT_THRESHOLD;
+    gscope->mod = NULL;
+    gscope->image = NULL;
+    gscope->image_size = 0;
 
     return gscope;
 }
@@ -371,9 +1448,11 @@ void gscope_append_routine(GScope *gscope, Routine *routine)
     if (gscope->rte_count == gscope->rte_capacity) {
         gscope->rte_capacity = gscope->rte_capacity == 0 ? GSCOPE_ROUTINES_INITIAL_CAPACITY : (gscope->rte_capacity*2);
 
-        gscope->routines = realloc(gscope->routines, gscope->rte_capacity*sizeof(*gscope->routines));
+        gscope->routines = mem_realloc(MEM_SCOPE, gscope->routines, gscope->rte_capacity*sizeof(*gscope->routines));
     }
 
+    routine->index = gscope->rte_count;
+    symbols_insert(&gscope->rte_symbols, routine->id, routine->index);
     gscope->routines[gscope->rte_count++] = routine;
 }
 
@@ -382,19 +1461,45 @@ void gscope_append_variable(GScope *gscope, Variable *variable)
     if (gscope->var_count == gscope->var_capacity) {
         gscope->var_capacity = gscope->var_capacity == 0 ? GSCOPE_VARIABLES_INITIAL_CAPACITY : (gscope->var_capacity*2);
 
-        gscope->variables = realloc(gscope->variables, gscope->var_capacity*sizeof(*gscope->variables));
+        gscope->variables = mem_realloc(MEM_SCOPE, gscope->variables, gscope->var_capacity*sizeof(*gscope->variables));
     }
 
+    symbols_insert(&gscope->var_symbols, variable->id, gscope->var_count);
     gscope->variables[gscope->var_count++] = variable;
 }
 
 void gscope_log_routines(GScope *gscope)
 {
+    Module *mod = gscope->mod;
+
     for (size_t j = 0; j < gscope->rte_count; ++j) {
-        printf("ID: %s\n", gscope->routines[j]->id);
-        for (size_t k = 0; k < gscope->routines[j]->tk_count; ++k) {
+        Routine *routine = gscope->routines[j];
+        printf("ID: %s\n", routine->id);
+
+        // routines left uncompiled in lazy mode still have their tokens
+        if (routine->state != COMPILE_DONE) {
+            for (size_t i = routine->src_start; i < routine->src_start + routine->src_count; ++i) {
+                printf("   ");
+                mod_log_token(mod, i, mod_type(mod, i), mod_txt(mod, i));
+            }
+            continue;
+        }
+
+        for (size_t k = 0; k < routine->code_count; ++k) {
+            Instr *in = &routine->code[k];
+            char buf[FMT_NUMBER_MAX_SIZE];
+            char *txt = mod_txt(mod, in->src);
+
+            // folded constants don't match the text of their first operand
+            int var_j = mod_type(mod, in->src) == ID_INVOCATION ? gscope_search_variable(gscope, txt) : -1;
+            bool named = var_j != -1 && gscope->variables[var_j]->constant == in->arg;
+            if (in->op == CONST_LOAD && !named && gscope->constants[in->arg]->type != VT_STRING) {
+                buf[value_format(buf, gscope->constants[in->arg])] = '\0';
+                txt = buf;
+            }
+
             printf("   ");
-            tk_log(gscope->routines[j]->tokens[k]);
+            mod_log_token(mod, in->src, in->op, txt);
         }
     }
 }
@@ -409,26 +1514,180 @@ void gscope_log_variables(GScope *gscope)
 
 void gscope_destroy(GScope *gscope)
 {
+    if (gscope->image != NULL) {
+        // only values bound after loading live outside of the image, and
+        // what tables of the image took since
+        for (size_t i = 0; i < gscope->var_count; ++i)
+            table_release_image(gscope->variables[i]->value);
+
+        munmap(gscope->image, gscope->image_size);
+        return;
+    }
+
+    // constants shared with tasks or daemon workers go back to plain refs,
+    // variables may hold the same values
+    for (size_t i = 0; i < gscope->const_count; ++i)
+        gscope->constants[i]->shared = false;
+
     for (size_t i = 0; i < gscope->rte_count; ++i) {
         rte_destroy(gscope->routines[i]);
     }
 
-    free(gscope->routines);
-    free(gscope);
+    for (size_t i = 0; i < gscope->var_count; ++i) {
+        var_destroy(gscope->variables[i]);
+    }
+
+    mem_free(gscope->routines);
+    mem_free(gscope->variables);
+    for (size_t i = 0; i < gscope->const_count; ++i) {
+        value_unref(gscope->constants[i]);
+    }
+
+    mem_free(gscope->constants);
+    mem_free(gscope->rte_symbols.slots);
+    mem_free(gscope->var_symbols.slots);
+    if (gscope->mod != NULL) mod_destroy(gscope->mod);
+    mem_free(gscope);
+}
+
+void gscope_eliminate_dead_code(GScope *gscope, char **entries, size_t entry_count)
+{
+    // keep only what the entry routines can reach through their invocations,
+    // this runs before compiling so names are still unresolved
+    bool *rte_live = mem_calloc(MEM_SCOPE, gscope->rte_count, sizeof(*rte_live));
+    bool *var_live = mem_calloc(MEM_SCOPE, gscope->var_count+1, sizeof(*var_live));
+    size_t *worklist = mem_alloc(MEM_SCOPE, gscope->rte_count*sizeof(*worklist));
+    size_t worklist_count = 0;
+
+    for (size_t e = 0; e < entry_count; ++e) {
+        int entry_j = gscope_search_routine(gscope, entries[e]);
+        if (entry_j == -1) {
+            fprintf(stderr, ERR_PREFIX"Entry point has not been declared: '%s'\n", ERR_EXP, entries[e]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (rte_live[entry_j]) continue;
+        rte_live[entry_j] = true;
+        worklist[worklist_count++] = entry_j;
+    }
+
+    Module *mod = gscope->mod;
+
+    while (worklist_count > 0) {
+        Routine *routine = gscope->routines[worklist[--worklist_count]];
+        const size_t end = routine->src_start + routine->src_count;
+
+        for (size_t i = routine->src_start; i < end; ++i) {
+            if (mod->types[i] != ID_INVOCATION) continue;
+
+            // same precedence as rte_resolve_symbols, routines first
+            int rte_j = gscope_search_routine(gscope, mod_txt(mod, i));
+            bool store = i+1 < end && mod->types[i+1] == OP_BIND;
+
+            if (rte_j != -1 && !store) {
+                if (!rte_live[rte_j]) {
+                    rte_live[rte_j] = true;
+                    worklist[worklist_count++] = rte_j;
+                }
+            } else {
+                int var_j = gscope_search_variable(gscope, mod_txt(mod, i));
+                if (var_j != -1) var_live[var_j] = true;
+            }
+        }
+    }
+
+    // compact both arrays, indices and symbols are assigned again
+    size_t count = 0;
+    symbols_clear(&gscope->rte_symbols);
+    for (size_t j = 0; j < gscope->rte_count; ++j) {
+        Routine *routine = gscope->routines[j];
+        if (!rte_live[j]) {
+            rte_destroy(routine);
+            continue;
+        }
+
+        routine->index = count;
+        symbols_insert(&gscope->rte_symbols, routine->id, count);
+        gscope->routines[count++] = routine;
+    }
+    gscope->rte_count = count;
+
+    count = 0;
+    symbols_clear(&gscope->var_symbols);
+    for (size_t j = 0; j < gscope->var_count; ++j) {
+        Variable *variable = gscope->variables[j];
+        if (!var_live[j]) {
+            var_destroy(variable);
+            continue;
+        }
+
+        symbols_insert(&gscope->var_symbols, variable->id, count);
+        gscope->variables[count++] = variable;
+    }
+    gscope->var_count = count;
+
+    mem_free(rte_live);
+    mem_free(var_live);
+    mem_free(worklist);
+}
+
+void gscope_mark_rebound_variables(GScope *gscope)
+{
+    // a global is rebound when some routine binds it, binds to a parameter
+    // or to a local of the same name don't count. Runs before compiling
+    for (size_t j = 0; j < gscope->var_count; ++j) {
+        gscope->variables[j]->rebound = false;
+    }
+
+    Module *mod = gscope->mod;
+
+    for (size_t j = 0; j < gscope->rte_count; ++j) {
+        Routine *routine = gscope->routines[j];
+        const size_t end = routine->src_start + routine->src_count;
+
+        for (size_t i = routine->src_start; i+1 < end; ++i) {
+            if (mod->types[i] != ID_INVOCATION || mod->types[i+1] != OP_BIND) continue;
+
+            char *txt = mod_txt(mod, i);
+            bool local = rte_search_slot(routine, txt) != -1;
+            for (size_t k = routine->src_start; k < end && !local; ++k)
+                local = mod->types[k] == ID_VAR && strcmp(mod_txt(mod, k), txt) == 0;
+
+            int var_j = gscope_search_variable(gscope, txt);
+            if (!local && var_j != -1) gscope->variables[var_j]->rebound = true;
+        }
+    }
+}
+
+void gscope_compile_routines(GScope *gscope)
+{
+    for (size_t j = 0; j < gscope->rte_count; ++j) {
+        if (gscope->routines[j]->state == COMPILE_PENDING)
+            rte_compile(gscope, gscope->routines[j]);
+    }
+}
+
+void scan_error(Location loc, const char *msg, const char *txt)
+{
+    fprintf(stderr, ERR_PREFIX"%zu:%zu: %s: '%s'\n", ERR_EXP, loc.row, loc.col, msg, txt);
+    exit(EXIT_FAILURE);
 }
 
 void scan_modules(GScope *gscope, Module *mod) {
     // this function currently takes as input one single module
     // but in the future, when the module system will be implemented
-    // it will accepts a dynamic array of modules
+    // it will accepts a dynamic array of modules. The gscope takes the
+    // module, routines refer to its tokens
+    gscope->mod = mod;
 
     const size_t mod_size = mod->count;
     bool entry_point_found = false;
 
     for (size_t i = 0; i < mod_size; ++i) {
-        Token *tk = mod->tokens[i];
+        Location loc = mod_loc(mod, i);
+        char *txt = mod_txt(mod, i);
 
-        switch (tk->ttype) {
+        switch (mod_type(mod, i)) {
 
             case VAR_SYM: break;
             case ROUTINE_SYM: break;
@@ -436,24 +1695,23 @@ void scan_modules(GScope *gscope, Module *mod) {
  
                 if (entry_point_found) {
                     // printf("variable\n");
-                    printf("dead code %zu:%zu\n", tk->loc.row, tk->loc.col);
+                    printf("dead code %zu:%zu\n", loc.row, loc.col);
                     i++;
 
                     break;
                 } else {
 
-                    assert(mod->tokens[i-1]->ttype == VAR_SYM);
-
-                    Token *value = mod->tokens[(++i)];
-
-                    // name checks
-                    assert(strcmp(tk->txt, "main") != 0);
+                    // user input, reported instead of asserted, a library host survives it
+                    if (i == 0 || mod_type(mod, i-1) != VAR_SYM) scan_error(loc, "variable without '@'", txt);
+                    if (strcmp(txt, "main") == 0) scan_error(loc, "'main' can't name a variable", txt);
 
-                    assert(value->ttype == LIT_INT || value->ttype == LIT_FLOAT || value->ttype == LIT_STRING || value->ttype == LIT_BOOL);
+                    TokenType value = i+1 < mod_size ? mod_type(mod, ++i) : UNKNOWN;
+                    if (value != LIT_INT && value != LIT_FLOAT && value != LIT_STRING && value != LIT_BOOL)
+                        scan_error(loc, "variable needs a literal value", txt);
 
                     ValueType vtype = VT_UNKNOWN;
 
-                    switch (value->ttype) {
+                    switch (value) {
                         case LIT_STRING: vtype = VT_STRING;
                             break;
                         case LIT_INT: vtype = VT_INT;
@@ -467,7 +1725,7 @@ void scan_modules(GScope *gscope, Module *mod) {
                             break;
                     }
 
-                    Variable *variable = var_create(tk->txt, value_create(value->txt,vtype));
+                    Variable *variable = var_create(txt, value_create(mod_txt(mod, i),vtype));
                     gscope_append_variable(gscope, variable);
                 }
 
@@ -476,30 +1734,63 @@ void scan_modules(GScope *gscope, Module *mod) {
             case ID_ROUTINE: {
 
                 if (entry_point_found) {
-                    printf("dead code %zu:%zu\n", tk->loc.row, tk->loc.col);
-                    while (mod->tokens[i-1]->ttype != KW_END) i++;
+                    printf("dead code %zu:%zu\n", loc.row, loc.col);
+                    while (mod_type(mod, i-1) != KW_END) i++;
                     break;
                 } else {
 
-                    assert(mod->tokens[i-1]->ttype == ROUTINE_SYM);
-                    if (strcmp(tk->txt, "main") == 0) {
+                    if (i == 0 || mod_type(mod, i-1) != ROUTINE_SYM) scan_error(loc, "routine without ':'", txt);
+                    if (strcmp(txt, "main") == 0) {
                         entry_point_found = true;
                     }
 
-                    // create routine and fill tokens array
-                    Routine *routine = rte_create(tk->txt, TOKENS_INITIAL_CAPACITY);
-                    while (mod->tokens[(++i)-1]->ttype != KW_END) {
-                        rte_append_token(routine, mod->tokens[i]);
+                    // create routine, its body is the range of tokens up to
+                    // end, the gscope keeps the module alive. Appended first,
+                    // so it's released with the gscope when the rest has errors
+                    Routine *routine = rte_create(txt);
+                    gscope_append_routine(gscope, routine);
+
+                    // parameters list, ":add(a, b)"
+                    if (i+1 < mod_size && mod_type(mod, i+1) == PAREN_OPEN_SYM) {
+                        i++;
+                        while (i+1 < mod_size && mod_type(mod, ++i) != PAREN_CLOSE_SYM) {
+                            char *param = mod_txt(mod, i);
+                            if (mod_type(mod, i) != ID_INVOCATION || rte_search_slot(routine, param) != -1) {
+                                Location param_loc = mod_loc(mod, i);
+                                fprintf(stderr, ERR_PREFIX"%zu:%zu: invalid parameter '%s' in routine '%s'\n",
+                                        ERR_EXP, param_loc.row, param_loc.col, param, routine->id);
+                                exit(EXIT_FAILURE);
+                            }
+
+                            rte_declare_slot(routine, param);
+                            routine->param_count++;
+                            if (i+1 < mod_size && mod_type(mod, i+1) == COMMA_SYM) i++;
+                        }
+
+                        if (mod_type(mod, i) != PAREN_CLOSE_SYM) {
+                            fprintf(stderr, ERR_PREFIX"%zu:%zu: unterminated parameters list in routine '%s'\n",
+                                    ERR_EXP, loc.row, loc.col, routine->id);
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+
+                    if (entry_point_found && routine->param_count > 0) {
+                        fprintf(stderr, ERR_PREFIX"%zu:%zu: entry point 'main' can't take parameters\n",
+                                ERR_EXP, loc.row, loc.col);
+                        exit(EXIT_FAILURE);
                     }
 
-                    gscope_append_routine(gscope, routine);
+                    routine->src_start = i+1;
+                    while (mod_type(mod, (++i)-1) != KW_END) {
+                        if (i >= mod_size) scan_error(loc, "routine without 'end'", txt);
+                        routine->src_count++;
+                    }
                 }
 
             } break;
 
             default: {
-                printf("TokenType not allowed: %s\n", ttype_tostr(tk->ttype));
-                assert(0 && "TokenType not allowed");
+                scan_error(loc, "only routines and variables are allowed here", txt);
             }
         }
 
@@ -1,10 +1,19 @@
 #ifndef LEXER_H_
 #define LEXER_H_
 #include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "memstats.h"
+#include "scan.h"
 
 #define MODULE_INITIAL_CAPACITY 128
-#define MAXIMUM_TOKEN_TXT_SIZE 64
+
+// inputs smaller than this are always lexed on the calling thread
+#define LEX_PARALLEL_MINIMUM_SIZE (1 << 20)
+#define LEX_MAXIMUM_THREADS 64
 
 typedef enum {
     UNKNOWN,
@@ -22,6 +31,11 @@ typedef enum {
     ID_ROUTINE,
     ROUTINE_SYM,
 
+    // routine parameters list
+    PAREN_OPEN_SYM,
+    PAREN_CLOSE_SYM,
+    COMMA_SYM,
+
     // keywords
     KW_END,
     KW_DUP,
@@ -29,6 +43,27 @@ typedef enum {
     KW_SWAP,
     KW_OVER,
     KW_CR,
+    KW_IF,
+    KW_ELSE,
+    KW_THEN,
+    KW_SPAWN,
+    KW_JOIN,
+    KW_PACK,
+    KW_UNPACK,
+    KW_RANGE,
+    KW_LEN,
+    KW_MAP,
+    KW_REDUCE,
+    KW_READ_LINE,
+    KW_EACH_LINE,
+    KW_CONCAT,
+    KW_SLICE,
+    KW_FIND,
+    KW_TABLE,
+    KW_INSERT,
+    KW_GET,
+    KW_REMOVE,
+    KW_CONTAINS,
 
     OP_SUM,
     OP_SUB,
@@ -37,10 +72,11 @@ typedef enum {
     OP_MOD,
 
     OP_EQ,
-    // OP_GT,
-    // OP_GTE,
-    // OP_LT,
-    // OP_LTE,
+    OP_NEQ,
+    OP_GT,
+    OP_GTE,
+    OP_LT,
+    OP_LTE,
 
     OP_EMIT,
     OP_PRINT,
@@ -48,6 +84,14 @@ typedef enum {
 
     OP_BIND,
 
+    // produced by the compiler from resolved invocations, never by the lexer
+    RTE_CALL,
+    VAR_LOAD,
+    VAR_STORE,
+    LOCAL_LOAD,
+    LOCAL_STORE,
+    CONST_LOAD,
+
     _IOTA
 } TokenType;
 
@@ -57,7 +101,7 @@ do {                                                          \
     enum_str_repr = calloc(iota, sizeof(char*)); \
     for (int i = 0; i < iota; ++i) {                       \
         char *str = (*enum_tostr_fn)((enum_type) i);               \
-        enum_str_repr[i] = malloc(strlen(str));   \
+        enum_str_repr[i] = malloc(strlen(str)+1); \
         strcpy(enum_str_repr[i], str);            \
     }                                                         \
 } while (0)
@@ -95,6 +139,15 @@ char *ttype_tostr(TokenType ttype)
         case ROUTINE_SYM:
             return "ROUTINE_SYM";
             break;
+        case PAREN_OPEN_SYM:
+            return "PAREN_OPEN_SYM";
+            break;
+        case PAREN_CLOSE_SYM:
+            return "PAREN_CLOSE_SYM";
+            break;
+        case COMMA_SYM:
+            return "COMMA_SYM";
+            break;
         case ID_VAR:
             return "ID_VAR";
             break;
@@ -119,6 +172,69 @@ char *ttype_tostr(TokenType ttype)
         case KW_CR:
             return "KW_CR";
             break;
+        case KW_IF:
+            return "KW_IF";
+            break;
+        case KW_ELSE:
+            return "KW_ELSE";
+            break;
+        case KW_THEN:
+            return "KW_THEN";
+            break;
+        case KW_SPAWN:
+            return "KW_SPAWN";
+            break;
+        case KW_JOIN:
+            return "KW_JOIN";
+            break;
+        case KW_PACK:
+            return "KW_PACK";
+            break;
+        case KW_UNPACK:
+            return "KW_UNPACK";
+            break;
+        case KW_RANGE:
+            return "KW_RANGE";
+            break;
+        case KW_LEN:
+            return "KW_LEN";
+            break;
+        case KW_MAP:
+            return "KW_MAP";
+            break;
+        case KW_REDUCE:
+            return "KW_REDUCE";
+            break;
+        case KW_READ_LINE:
+            return "KW_READ_LINE";
+            break;
+        case KW_EACH_LINE:
+            return "KW_EACH_LINE";
+            break;
+        case KW_CONCAT:
+            return "KW_CONCAT";
+            break;
+        case KW_SLICE:
+            return "KW_SLICE";
+            break;
+        case KW_FIND:
+            return "KW_FIND";
+            break;
+        case KW_TABLE:
+            return "KW_TABLE";
+            break;
+        case KW_INSERT:
+            return "KW_INSERT";
+            break;
+        case KW_GET:
+            return "KW_GET";
+            break;
+        case KW_REMOVE:
+            return "KW_REMOVE";
+            break;
+        case KW_CONTAINS:
+            return "KW_CONTAINS";
+            break;
         case OP_SUM:
             return "OP_SUM";
             break;
@@ -149,6 +265,39 @@ char *ttype_tostr(TokenType ttype)
         case OP_EQ:
             return "OP_EQ";
             break;
+        case OP_NEQ:
+            return "OP_NEQ";
+            break;
+        case OP_GT:
+            return "OP_GT";
+            break;
+        case OP_GTE:
+            return "OP_GTE";
+            break;
+        case OP_LT:
+            return "OP_LT";
+            break;
+        case OP_LTE:
+            return "OP_LTE";
+            break;
+        case RTE_CALL:
+            return "RTE_CALL";
+            break;
+        case VAR_LOAD:
+            return "VAR_LOAD";
+            break;
+        case VAR_STORE:
+            return "VAR_STORE";
+            break;
+        case LOCAL_LOAD:
+            return "LOCAL_LOAD";
+            break;
+        case LOCAL_STORE:
+            return "LOCAL_STORE";
+            break;
+        case CONST_LOAD:
+            return "CONST_LOAD";
+            break;
         default:
             assert(0 && "Unreachable, missing implementation of one or multiple enum values");
             break;
@@ -160,95 +309,115 @@ typedef struct {
     size_t col;
 } Location;
 
+// Tokens of a module are stored by field, one array per field indexed by
+// token number, so passes that only look at types walk a byte array. The
+// text of every token lives in one pool, each entry NUL terminated
 typedef struct {
-    char* txt;
-    Location loc;
-    TokenType ttype;
-} Token;
+    uint32_t row;
+    uint32_t col;
+} TokenLoc;
 
 typedef struct {
-    Token **tokens;
+    uint8_t *types;
+    uint32_t *txt_offsets;
+    uint32_t *txt_lens;
+    TokenLoc *locs;
     size_t count;
     size_t capacity;
+
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+
     char *file_path;
 } Module;
 
-Token *tk_create(char *txt, Location loc, TokenType ttype)
+Module *mod_create(char *file_path, const size_t initial_capacity)
 {
-    Token *token = malloc(sizeof(Token));
-    if (token == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
-
-    // this function manages memory on its own
-    token->txt = malloc(strlen(txt));
-    if (token->txt == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
+    Module *mod = mem_alloc(MEM_LEXER, sizeof(Module));
 
-    // copy whatever takes as parameter
-    strcpy(token->txt, txt);
+    mod->file_path = file_path;
+    mod->count = 0;
+    mod->capacity = initial_capacity;
 
-    token->loc = loc;
-    token->ttype = ttype;
-    return token;
-}
+    mod->types = mem_alloc(MEM_LEXER, initial_capacity*sizeof(*mod->types));
+    mod->txt_offsets = mem_alloc(MEM_LEXER, initial_capacity*sizeof(*mod->txt_offsets));
+    mod->txt_lens = mem_alloc(MEM_LEXER, initial_capacity*sizeof(*mod->txt_lens));
+    mod->locs = mem_alloc(MEM_LEXER, initial_capacity*sizeof(*mod->locs));
 
-void tk_log(Token *token)
-{
-    printf("%-15s:%zu:%-5zu %-15s\n", ttype_tostr(token->ttype), token->loc.row, token->loc.col, token->txt);
-}
+    // tokens average a handful of chars
+    mod->text_size = 0;
+    mod->text_capacity = initial_capacity*8;
+    mod->text = mem_alloc(MEM_LEXER, mod->text_capacity);
 
-void tk_destroy(Token *token)
-{
-    free(token->txt);
-    free(token);
+    return mod;
 }
 
-Module *mod_create(char *file_path, const size_t initial_capacity)
+void mod_reserve(Module *mod, size_t count, size_t text_size)
 {
-    Module *mod = malloc(sizeof(Module));
-    if (mod == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
+    // room for count more tokens holding text_size more bytes of text
+    if (mod->count + count > mod->capacity) {
+        while (mod->count + count > mod->capacity)
+            mod->capacity = mod->capacity == 0 ? MODULE_INITIAL_CAPACITY : (mod->capacity*2);
+
+        mod->types = mem_realloc(MEM_LEXER, mod->types, mod->capacity*sizeof(*mod->types));
+        mod->txt_offsets = mem_realloc(MEM_LEXER, mod->txt_offsets, mod->capacity*sizeof(*mod->txt_offsets));
+        mod->txt_lens = mem_realloc(MEM_LEXER, mod->txt_lens, mod->capacity*sizeof(*mod->txt_lens));
+        mod->locs = mem_realloc(MEM_LEXER, mod->locs, mod->capacity*sizeof(*mod->locs));
     }
 
-    mod->file_path = file_path;
-    mod->count = 0;
-    mod->capacity = initial_capacity;
+    if (mod->text_size + text_size > mod->text_capacity) {
+        while (mod->text_size + text_size > mod->text_capacity)
+            mod->text_capacity = mod->text_capacity == 0 ? MODULE_INITIAL_CAPACITY : (mod->text_capacity*2);
 
-    mod->tokens = calloc(initial_capacity, sizeof(*mod->tokens));
-    if (mod->tokens == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
+        if (mod->text_capacity > UINT32_MAX) {
+            fprintf(stderr, ERR_PREFIX"%s: source is too large\n", ERR_EXP, mod->file_path);
+            exit(EXIT_FAILURE);
+        }
+        mod->text = mem_realloc(MEM_LEXER, mod->text, mod->text_capacity);
     }
+}
 
-    return mod;
+void mod_append(Module *mod, const char *txt, size_t len, Location loc, TokenType ttype)
+{
+    // copy len bytes of txt into the pool
+    mod_reserve(mod, 1, len+1);
+
+    size_t i = mod->count++;
+    mod->types[i] = (uint8_t) ttype;
+    mod->txt_offsets[i] = (uint32_t) mod->text_size;
+    mod->txt_lens[i] = (uint32_t) len;
+    mod->locs[i] = (TokenLoc) {(uint32_t) loc.row, (uint32_t) loc.col};
+
+    memcpy(mod->text + mod->text_size, txt, len);
+    mod->text[mod->text_size + len] = '\0';
+    mod->text_size += len+1;
 }
 
-void mod_append(Module *mod, Token *token)
+TokenType mod_type(Module *mod, size_t i)
 {
-    // reallocate memory doubling space
-    if (mod->count == mod->capacity) {
+    return (TokenType) mod->types[i];
+}
 
-        // new computed capacity
-        mod->capacity = mod->capacity == 0 ? MODULE_INITIAL_CAPACITY : (mod->capacity*2);
+char *mod_txt(Module *mod, size_t i)
+{
+    return mod->text + mod->txt_offsets[i];
+}
 
-        mod->tokens = realloc(mod->tokens, mod->capacity*sizeof(*mod->tokens));
-        if (mod->tokens == NULL) {
-            fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-            exit(EXIT_FAILURE);
-        }
-    }
+Location mod_loc(Module *mod, size_t i)
+{
+    return (Location) {mod->locs[i].row, mod->locs[i].col};
+}
 
-    mod->tokens[mod->count++] = token;
+TokenType mod_top_type(Module *mod)
+{
+    return mod_type(mod, mod->count-1);
 }
 
-Token *mod_top(Module *mod)
+void mod_log_token(Module *mod, size_t i, TokenType ttype, const char *txt)
 {
-    return *(mod->tokens + mod->count-1);
+    // type and text may differ from the lexed ones once a routine is compiled
+    printf("%-15s:%u:%-5u %-15s\n", ttype_tostr(ttype), mod->locs[i].row, mod->locs[i].col, txt);
 }
 
 void mod_log(Module *mod)
@@ -256,189 +425,365 @@ void mod_log(Module *mod)
     printf("PATH: %s\n", mod->file_path);
     for (size_t i = 0; i < mod->count; ++i) {
         printf("   ");
-        tk_log(*(mod->tokens+i));
+        mod_log_token(mod, i, mod_type(mod, i), mod_txt(mod, i));
     }
 }
 
 void mod_destroy(Module *mod)
 {
-    // deallocate all tokens
-    for (size_t i = 0; i < mod->count; ++i)
-        tk_destroy(*(mod->tokens+i));
+    mem_free(mod->types);
+    mem_free(mod->txt_offsets);
+    mem_free(mod->txt_lens);
+    mem_free(mod->locs);
+    mem_free(mod->text);
+    mem_free(mod);
+}
 
-    free(mod->tokens);
-    free(mod);
+
+bool lex_word_is(const char *txt, size_t len, const char *word)
+{
+    return strlen(word) == len && memcmp(txt, word, len) == 0;
 }
 
+TokenType lex_word_type(const char *txt, size_t len)
+{
+    // keywords, everything else is an identifier invocation
+    if (lex_word_is(txt, len, "end")) return KW_END;
+    else if (lex_word_is(txt, len, "dup")) return KW_DUP;
+    else if (lex_word_is(txt, len, "drop")) return KW_DROP;
+    else if (lex_word_is(txt, len, "swap")) return KW_SWAP;
+    else if (lex_word_is(txt, len, "over")) return KW_OVER;
+
+    else if (lex_word_is(txt, len, "cr")) return KW_CR;
+    else if (lex_word_is(txt, len, "emit")) return OP_EMIT;
+
+    else if (lex_word_is(txt, len, "if")) return KW_IF;
+    else if (lex_word_is(txt, len, "else")) return KW_ELSE;
+    else if (lex_word_is(txt, len, "then")) return KW_THEN;
+
+    else if (lex_word_is(txt, len, "spawn")) return KW_SPAWN;
+    else if (lex_word_is(txt, len, "join")) return KW_JOIN;
+
+    else if (lex_word_is(txt, len, "pack")) return KW_PACK;
+    else if (lex_word_is(txt, len, "unpack")) return KW_UNPACK;
+    else if (lex_word_is(txt, len, "range")) return KW_RANGE;
+    else if (lex_word_is(txt, len, "len")) return KW_LEN;
+    else if (lex_word_is(txt, len, "map")) return KW_MAP;
+    else if (lex_word_is(txt, len, "reduce")) return KW_REDUCE;
+    else if (lex_word_is(txt, len, "read-line")) return KW_READ_LINE;
+    else if (lex_word_is(txt, len, "each-line")) return KW_EACH_LINE;
+    else if (lex_word_is(txt, len, "concat")) return KW_CONCAT;
+    else if (lex_word_is(txt, len, "slice")) return KW_SLICE;
+    else if (lex_word_is(txt, len, "find")) return KW_FIND;
+    else if (lex_word_is(txt, len, "table")) return KW_TABLE;
+    else if (lex_word_is(txt, len, "insert")) return KW_INSERT;
+    else if (lex_word_is(txt, len, "get")) return KW_GET;
+    else if (lex_word_is(txt, len, "remove")) return KW_REMOVE;
+    else if (lex_word_is(txt, len, "contains")) return KW_CONTAINS;
+
+    else if (lex_word_is(txt, len, "true") || lex_word_is(txt, len, "false")) return LIT_BOOL;
+
+    return ID_INVOCATION;
+}
 
-Module *lex_buffer(char* buffer, char* file_path)
+void lex_range(Module *mod, char *buffer, size_t start, size_t buffer_size, size_t row)
 {
-    Module *mod = mod_create(file_path, MODULE_INITIAL_CAPACITY);
-    size_t buffer_size = strlen(buffer);
+    // lex buffer[start..buffer_size), start must be the beginning of a line
+    char *file_path = mod->file_path;
 
     // current char position
-    size_t c = 0;
+    size_t c = start;
 
-    // location tracking
-    size_t row, col;
-    row = col = 1;
+    // location tracking, column is derived from the start of current line
+    size_t line_start = start;
 
     while (c < buffer_size) {
-        if (buffer[c] == '\n') {
-            // find a new line
-            row++;
-            c++;
-            col = 1;
-        } else if (isspace(buffer[c])) {
-            c++;
-            col++;
-        } else if (buffer[c] == ';') {
+        c = scan_skip_space(buffer, c, buffer_size, &row, &line_start);
+        if (c == buffer_size) break;
+
+        if (buffer[c] == ';') {
             // encountered a comment, find end of line
+            c = scan_find_byte(buffer, c+1, buffer_size, '\n');
+            continue;
+        }
+
+        // token has been found, txt_start and txt_len delimit its text
+        TokenType ttype = UNKNOWN;
+        size_t col_start = c - line_start + 1;
+        size_t txt_start = c;
+        size_t txt_len = 0;
+
+        if (buffer[c] == '"') {
+
+            // skip opening double quotes
             c++;
-            while (buffer[c] != '\n') c++;
-        } else {
+            txt_start = c;
+            col_start++;
+
+            // allow char escaping, find end of string literal
+            c = scan_find_string_end(buffer, c, buffer_size);
+            if (c == buffer_size) {
+                fprintf(stderr, ERR_PREFIX"%s:%zu:%zu: Unterminated string literal\n", ERR_EXP, file_path, row, col_start-1);
+                exit(EXIT_FAILURE);
+            }
 
-            // token has been found
-            char* txt = calloc(MAXIMUM_TOKEN_TXT_SIZE, 1);
-            TokenType ttype = UNKNOWN;
+            txt_len = c - txt_start;
+            ttype = LIT_STRING;
 
-            // column on which token start
-            size_t col_start = 0;
+            // skip closing double quotes
+            c++;
 
-            // txt start position related to buffer
-            size_t c_start = c;
+        } else if (CHAR_IS(buffer[c], CC_ALPHA)) {
+            // find identifier or keyword, allow numbers and hyphen symbol
+            // after first char
+            while (c < buffer_size && CHAR_IS(buffer[c], CC_IDENT)) c++;
+            txt_len = c - txt_start;
+
+            // determine token type
+            if (mod->count != 0) {
+                // check if it is and identifier
+                TokenType tt = mod_top_type(mod);
+                if (tt == ROUTINE_SYM) ttype = ID_ROUTINE;
+                else if (tt == VAR_SYM) ttype = ID_VAR;
+            }
 
-            if (buffer[c] == '"') {
+            // type stills unkown, so it's not an ID
+            if (ttype == UNKNOWN) ttype = lex_word_type(buffer + txt_start, txt_len);
 
-                // skip opening double quotes
-                c++;
-                col++;
-                c_start++;
+        } else if (CHAR_IS(buffer[c], CC_DIGIT)) {
+            // find numeric literal
 
-                col_start = col;
-                // allow char escaping, find end of string literal
-                while (buffer[c] != '"' || buffer[c-1] == '\\') {
+            // current number is negative, sign is part of the text
+            if (c > 0 && buffer[c-1] == '-') txt_start--;
+
+            bool flt = false;
+            while (c < buffer_size && CHAR_IS(buffer[c], CC_DIGIT)) {
+                c++;
+                if (buffer[c] == '.') {
+                    flt = true;
                     c++;
-                    col++;
                 }
+            }
 
-                strncat(txt, buffer + c_start, c - c_start);
-                ttype = LIT_STRING;
+            txt_len = c - txt_start;
+            if (flt) ttype = LIT_FLOAT;
+            else ttype = LIT_INT;
 
-                // skip closing double quotes
-                c++;
-                col++;
+        } else {
+            // find a symbol, or whatever doesn't match previous if statements
+            txt_len = 1;
+            char next = buffer[c+1];
+
+            switch (buffer[c]) {
+                case '@': ttype = VAR_SYM;
+                    break;
+                case ':': ttype = ROUTINE_SYM;
+                    break;
+                case '(': ttype = PAREN_OPEN_SYM;
+                    break;
+                case ')': ttype = PAREN_CLOSE_SYM;
+                    break;
+                case ',': ttype = COMMA_SYM;
+                    break;
+                case '+': ttype = OP_SUM;
+                    break;
+                case '*': ttype = OP_MUL;
+                    break;
+                case '/': ttype = OP_DIV;
+                    break;
+                case '%': ttype = OP_MOD;
+                    break;
+                case '=': {
+                    if (next == '=') {
+                        ttype = OP_EQ;
+                        txt_len = 2;
+                    } else ttype = OP_BIND;
+                } break;
+                case '!': {
+                    if (next == '=') {
+                        ttype = OP_NEQ;
+                        txt_len = 2;
+                    }
+                } break;
+                case '<': {
+                    if (next == '=') {
+                        ttype = OP_LTE;
+                        txt_len = 2;
+                    } else ttype = OP_LT;
+                } break;
+                case '>': {
+                    if (next == '=') {
+                        ttype = OP_GTE;
+                        txt_len = 2;
+                    } else ttype = OP_GT;
+                } break;
+                case '-': {
+                    // a minus followed by a digit belongs to the number
+                    if (!CHAR_IS(next, CC_DIGIT)) ttype = OP_SUB;
+                    else txt_len = 0;
+                } break;
+                case '.': {
+                    if (next == 'm' && buffer[c+2] == 'e' && buffer[c+3] == 'm') {
+                        ttype = OP_PRINT_MEM;
+                        txt_len = 4;
+                    } else ttype = OP_PRINT;
+                } break;
+                default: break;
+            }
 
-            } else if (isalpha(buffer[c])) {
-                // find identifier or keyword
+            if (ttype == UNKNOWN && txt_len != 0) {
+                fprintf(stderr, ERR_PREFIX"Symbol not recognized: %c\n", ERR_EXP, buffer[c]);
+                exit(EXIT_FAILURE);
+            }
 
-                col_start = col;
-                // allow numbers and hyphen symbol after first char
-                while (isalnum(buffer[c]) || buffer[c] == '-') {
-                    c++;
-                    col++;
-                }
+            c += txt_len == 0 ? 1 : txt_len;
+        }
 
-                strncat(txt, buffer + c_start, c - c_start);
 
-                // determine token type
-                if (mod->count != 0) {
-                    // check if it is and identifier
-                    TokenType tt = mod_top(mod)->ttype;
-                    if (tt == ROUTINE_SYM) ttype = ID_ROUTINE;
-                    else if (tt == VAR_SYM) ttype = ID_VAR;
-                }
+        // if type is unknow then current token should not be added to the outcome
+        if (ttype != UNKNOWN) mod_append(mod, buffer + txt_start, txt_len, (Location) {row, col_start}, ttype);
+    }
+}
 
-                // type stills unkown, so it's not an ID
-                if (ttype == UNKNOWN) {
-                    // check if it is a keyword
-                    if (strcmp(txt, "end") == 0) ttype = KW_END;
-                    else if (strcmp(txt, "dup") == 0) ttype = KW_DUP;
-                    else if (strcmp(txt, "drop") == 0) ttype = KW_DROP; 
-                    else if (strcmp(txt, "swap") == 0) ttype = KW_SWAP; 
-                    else if (strcmp(txt, "over") == 0) ttype = KW_OVER; 
+Module *lex_buffer(char* buffer, char* file_path)
+{
+    Module *mod = mod_create(file_path, MODULE_INITIAL_CAPACITY);
+    lex_range(mod, buffer, 0, strlen(buffer), 1);
+    return mod;
+}
 
-                    else if (strcmp(txt, "cr") == 0) ttype = KW_CR;
-                    else if (strcmp(txt, "emit") == 0) ttype = OP_EMIT;
+// Parallel lexing: the buffer is split at line starts that are outside
+// string literals, chunks are lexed on worker threads and the resulting
+// token arrays are stitched back together in order
 
-                    else if (strcmp(txt, "true") == 0 || strcmp(txt, "false") == 0)
-                        ttype = LIT_BOOL;
+typedef struct {
+    Module *mod;
+    char *buffer;
+    size_t start;
+    size_t end;
+    size_t row;
+} LexChunk;
 
-                    // identifier invacation
-                    else ttype = ID_INVOCATION;
-                }
+size_t lex_split_chunks(char *buffer, size_t buffer_size, LexChunk *chunks, size_t max_chunks)
+{
+    // walk the buffer jumping from one interesting byte to the next, keeping
+    // track of rows the same way lex_range does (newlines inside strings
+    // don't count), and cut at the first line start past each target
+    size_t chunk_count = 0;
+    size_t chunk_size = buffer_size/max_chunks;
+    size_t pos = 0;
+    size_t row = 1;
+
+    chunks[chunk_count++] = (LexChunk) {.start = 0, .row = 1};
+
+    while (pos < buffer_size && chunk_count < max_chunks) {
+        size_t target = chunk_count*chunk_size;
+
+        while (pos < buffer_size) {
+            size_t nl = scan_find_byte(buffer, pos, buffer_size, '\n');
+            size_t quote = scan_find_byte(buffer, pos, nl, '"');
+            size_t comment = scan_find_byte(buffer, pos, quote, ';');
+
+            if (comment < quote) {
+                // rest of the line is a comment
+                pos = nl;
+            } else if (quote < nl) {
+                pos = scan_find_string_end(buffer, quote+1, buffer_size);
+                if (pos < buffer_size) pos++;
+                continue;
+            } else pos = nl;
+
+            if (pos < buffer_size) {
+                pos++;
+                row++;
+                if (pos >= target) break;
+            }
+        }
 
-            } else if (isdigit(buffer[c])) {
-                // find numeric literal
+        if (pos < buffer_size) {
+            chunks[chunk_count-1].end = pos;
+            chunks[chunk_count++] = (LexChunk) {.start = pos, .row = row};
+        }
+    }
 
-                // current number is negative
-                if (buffer[c-1] == '-') strcat(txt, "-");
+    chunks[chunk_count-1].end = buffer_size;
+    return chunk_count;
+}
 
-                bool flt = false;
-                col_start = col;
-                while (isdigit(buffer[c])) {
-                    c++;
-                    col++;
-                    if (buffer[c] == '.') {
-                        flt = true;
-                        c++;
-                        col++;
-                    }
-                }
+void *lex_chunk_worker(void *arg)
+{
+    LexChunk *chunk = arg;
+    lex_range(chunk->mod, chunk->buffer, chunk->start, chunk->end, chunk->row);
+    mem_stats_flush();
+    return NULL;
+}
 
-                strncat(txt, buffer + c_start, c - c_start);
-                if (flt) ttype = LIT_FLOAT;
-                else ttype = LIT_INT;
-
-            } else {
-                // find a symbol, or whatever doesn't match previous if statements
-                col_start = col;
-                strncat(txt, buffer + c_start, 1);
-
-                if (strcmp(txt, "@") == 0) ttype = VAR_SYM;
-                else if (strcmp(txt, ":") == 0) ttype = ROUTINE_SYM;
-                else if (strcmp(txt, "+") == 0) ttype = OP_SUM;
-                else if (strcmp(txt, "*") == 0) ttype = OP_MUL;
-                else if (strcmp(txt, "/") == 0) ttype = OP_DIV;
-                else if (strcmp(txt, "%") == 0) ttype = OP_MOD;
-                else if (strcmp(txt, "=") == 0) {
-                    if (buffer[c+1] == '=') {
-                        strncat(txt, buffer + c_start, 1);
-                        ttype = OP_EQ;
-                        c++;
-                    }
-                    else ttype = OP_BIND;
-                }
+void lex_fix_seam(Module *prev, Module *next)
+{
+    // an identifier gets its ID_ROUTINE/ID_VAR type from the token before
+    // it, which lives in the previous chunk when the name starts a line. Only
+    // words are retyped, keywords too like lex_range does, a string literal
+    // starting with a letter is left alone
+    if (prev->count == 0 || next->count == 0) return;
 
-                else if (strcmp(txt, "-") == 0) {
-                    if (!isdigit(buffer[c+1])) ttype = OP_SUB;
-                }
-                else if (strcmp(txt, ".") == 0) {
-                    if (buffer[c+1] == 'm' && buffer[c+2] == 'e' && buffer[c+3] == 'm') {
-                            strncat(txt, buffer + c_start, 3);
-                            ttype = OP_PRINT_MEM;
-                            c += 3;
-                    } else ttype = OP_PRINT;
-                }
+    TokenType tt = mod_top_type(prev);
+    if (next->types[0] == LIT_STRING || !CHAR_IS(mod_txt(next, 0)[0], CC_ALPHA)) return;
 
-                else {
-                    fprintf(stderr, ERR_PREFIX"Symbol not recognized: %s\n", ERR_EXP, txt);
-                    exit(EXIT_FAILURE);
-                }
+    if (tt == ROUTINE_SYM) next->types[0] = ID_ROUTINE;
+    else if (tt == VAR_SYM) next->types[0] = ID_VAR;
+}
 
-                c++;
-                col++;
-            }
+Module *lex_buffer_parallel(char *buffer, char *file_path, size_t threads)
+{
+    size_t buffer_size = strlen(buffer);
+    if (threads == 0) threads = (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > LEX_MAXIMUM_THREADS) threads = LEX_MAXIMUM_THREADS;
 
+    // small inputs are not worth the threads
+    if (threads <= 1 || buffer_size < LEX_PARALLEL_MINIMUM_SIZE) return lex_buffer(buffer, file_path);
 
-            // if type is unknow then current token should not be added to the outcome
-            if (ttype != UNKNOWN) {
-                Token *tk = tk_create(txt, (Location) {row, col_start}, ttype);
-                mod_append(mod, tk);
-            }
+    LexChunk chunks[LEX_MAXIMUM_THREADS];
+    size_t chunk_count = lex_split_chunks(buffer, buffer_size, chunks, threads);
+
+    pthread_t workers[LEX_MAXIMUM_THREADS];
+    for (size_t k = 0; k < chunk_count; ++k) {
+        chunks[k].buffer = buffer;
+        chunks[k].mod = mod_create(file_path, MODULE_INITIAL_CAPACITY);
+        if (pthread_create(&workers[k], NULL, lex_chunk_worker, &chunks[k]) != 0) {
+            fprintf(stderr, ERR_PREFIX"Could not create lexer thread\n", ERR_EXP);
+            exit(EXIT_FAILURE);
         }
     }
 
+    size_t token_count = 0;
+    size_t text_size = 0;
+    for (size_t k = 0; k < chunk_count; ++k) {
+        pthread_join(workers[k], NULL);
+        token_count += chunks[k].mod->count;
+        text_size += chunks[k].mod->text_size;
+    }
+
+    // stitch chunks in order, text offsets are moved by the text before them
+    Module *mod = mod_create(file_path, 0);
+    mod_reserve(mod, token_count, text_size);
+    for (size_t k = 0; k < chunk_count; ++k) {
+        Module *chunk = chunks[k].mod;
+        if (k > 0) lex_fix_seam(chunks[k-1].mod, chunk);
+
+        size_t at = mod->count;
+        memcpy(mod->types + at, chunk->types, chunk->count*sizeof(*chunk->types));
+        memcpy(mod->txt_lens + at, chunk->txt_lens, chunk->count*sizeof(*chunk->txt_lens));
+        memcpy(mod->locs + at, chunk->locs, chunk->count*sizeof(*chunk->locs));
+        for (size_t i = 0; i < chunk->count; ++i)
+            mod->txt_offsets[at + i] = chunk->txt_offsets[i] + (uint32_t) mod->text_size;
+
+        memcpy(mod->text + mod->text_size, chunk->text, chunk->text_size);
+        mod->text_size += chunk->text_size;
+        mod->count += chunk->count;
+    }
+
+    for (size_t k = 0; k < chunk_count; ++k) mod_destroy(chunks[k].mod);
+
     return mod;
 }
 
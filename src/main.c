@@ -8,9 +8,15 @@
 #define ERR_PREFIX "ERROR %s:%d: "          // error prefix for file path and line number
 #define ERR_EXP __FILE__, __LINE__    // arguments expansion
 
+#include "trap.h"
 #include "stack.h"
 #include "lexer.h"
 #include "interpreter.h"
+#include "batch.h"
+#include "daemon.h"
+#include "image.h"
+#include "tasks.h"
+#include "input.h"
 
 size_t get_file_content_length(FILE *file_pointer)
 {
@@ -46,11 +52,7 @@ char *read_content_from_file(const char *file_path)
     size_t buffer_size = get_file_content_length(file_pointer)+1;
 
     // allocate necessary memory
-    char* buffer = calloc(1, buffer_size);
-    if (buffer == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
+    char* buffer = mem_calloc(MEM_LEXER, 1, buffer_size);
 
     // read 1*buffer_size bytes from file
     size_t read_bytes = fread(buffer, 1, buffer_size, file_pointer);
@@ -70,22 +72,192 @@ void build_enums_str_reprs()
 #define MEM_CAPACITY 128
 #define FILE_PATH "examples/tests.pc"
 
-int main()
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] [file]\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    --inline-threshold=N    inline routines with at most N tokens (default %d)\n", INLINE_DEFAULT_THRESHOLD);
+    fprintf(stderr, "    --no-inline             disable inlining, every invocation is a real call\n");
+    fprintf(stderr, "    --lazy                  compile routines on their first call instead of at load\n");
+    fprintf(stderr, "    --no-dce                keep routines and variables main can't reach\n");
+    fprintf(stderr, "    --batch=ROUTINE         run ROUTINE instead of main once per line of stdin, each\n");
+    fprintf(stderr, "                            line holding the initial stack, and print the results\n");
+    fprintf(stderr, "    --init=ROUTINE          run ROUTINE before main, to initialize globals\n");
+    fprintf(stderr, "    --save-image=PATH       compile, run --init if any and write the resulting\n");
+    fprintf(stderr, "                            program to the image PATH instead of running it\n");
+    fprintf(stderr, "    --load-image=PATH       run the program of the image PATH, no file is read\n");
+    fprintf(stderr, "    --serve=SOCKET          keep serving run requests on the Unix socket SOCKET\n");
+    fprintf(stderr, "                            instead of running a file, see src/daemon.h\n");
+    fprintf(stderr, "    --workers=N             threads serving requests (default %d)\n", DAEMON_DEFAULT_WORKERS);
+    fprintf(stderr, "    --task-workers=N        run spawned tasks on N threads (default: one per core)\n");
+    fprintf(stderr, "    --lex-threads=N         lex large sources on N threads (default: one per core)\n");
+    fprintf(stderr, "    --mem-stats             report allocations per subsystem at exit\n");
+    fprintf(stderr, "    --trace[=N]             keep the last N executed tokens (default %d), dumped\n", TRACE_DEFAULT_CAPACITY);
+    fprintf(stderr, "                            on error or when receiving SIGUSR1\n");
+    fprintf(stderr, "    --trace-file=PATH       also write every executed token to a binary trace file\n");
+    fprintf(stderr, "    --trace-replay=PATH     print the content of a binary trace file and exit\n");
+    fprintf(stderr, "    --profile=PATH          sample routine call chains and write folded stacks\n");
+    fprintf(stderr, "                            (flamegraph input) to PATH, best with --no-inline\n");
+    fprintf(stderr, "    --profile-hz=N          profiler sampling frequency (default %d)\n", PROFILE_DEFAULT_HZ);
+}
+
+void run_batch_from_stdin(Routine *routine, GScope *gscope)
+{
+    // one input stack per line, results are printed in the same order
+    Stack **stacks = mem_calloc(MEM_STACK, BATCH_DEFAULT_LANES, sizeof(*stacks));
+    char *line = NULL;
+    size_t line_capacity = 0;
+    bool eof = false;
+
+    while (!eof) {
+        size_t n = 0;
+        while (n < BATCH_DEFAULT_LANES && !(eof = getline(&line, &line_capacity, stdin) == -1))
+            stacks[n++] = st_create_from_line(line, MEM_CAPACITY);
+
+        rte_execute_batch(routine, stacks, n, gscope);
+
+        for (size_t k = 0; k < n; ++k) {
+            st_display(stacks[k]);
+            st_destroy_from_heap(stacks[k]);
+        }
+    }
+
+    free(line);
+    mem_free(stacks);
+}
+
+void report_mem_stats(void)
+{
+    mem_report(stderr);
+}
+
+int main(int argc, char **argv)
 {
-    char *buffer = read_content_from_file(FILE_PATH);
-    Module *mod = lex_buffer(buffer, FILE_PATH);
+    char *file_path = FILE_PATH;
+    size_t inline_threshold = INLINE_DEFAULT_THRESHOLD;
+    size_t lex_threads = 0;
+    bool lazy = false;
+    bool dce = true;
+    char *entry = "main";
+    bool batch = false;
+    char *socket_path = NULL;
+    char *init = NULL;
+    char *save_image_path = NULL;
+    char *load_image_path = NULL;
+    size_t workers = DAEMON_DEFAULT_WORKERS;
+    size_t task_workers = 0;
+    size_t trace_capacity = 0;
+    char *trace_file_path = NULL;
+    char *profile_path = NULL;
+    unsigned profile_hz = PROFILE_DEFAULT_HZ;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--inline-threshold=", 19) == 0) {
+            inline_threshold = (size_t) atoi(argv[i] + 19);
+        } else if (strcmp(argv[i], "--no-inline") == 0) {
+            inline_threshold = 0;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[i], "--no-dce") == 0) {
+            dce = false;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            entry = argv[i] + 8;
+            batch = true;
+        } else if (strncmp(argv[i], "--init=", 7) == 0) {
+            init = argv[i] + 7;
+        } else if (strncmp(argv[i], "--save-image=", 13) == 0) {
+            save_image_path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--load-image=", 13) == 0) {
+            load_image_path = argv[i] + 13;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            socket_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            workers = (size_t) atoi(argv[i] + 10);
+            if (workers == 0) workers = 1;
+        } else if (strncmp(argv[i], "--task-workers=", 15) == 0) {
+            task_workers = (size_t) atoi(argv[i] + 15);
+            if (task_workers == 0) task_workers = 1;
+        } else if (strncmp(argv[i], "--lex-threads=", 14) == 0) {
+            lex_threads = (size_t) atoi(argv[i] + 14);
+            if (lex_threads == 0) lex_threads = 1;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            // registered first so it runs on error exits as well
+            atexit(report_mem_stats);
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_capacity = TRACE_DEFAULT_CAPACITY;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace_capacity = (size_t) atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--trace-file=", 13) == 0) {
+            trace_file_path = argv[i] + 13;
+            if (trace_capacity == 0) trace_capacity = TRACE_DEFAULT_CAPACITY;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile_path = argv[i] + 10;
+        } else if (strncmp(argv[i], "--profile-hz=", 13) == 0) {
+            profile_hz = (unsigned) atoi(argv[i] + 13);
+        } else if (strncmp(argv[i], "--trace-replay=", 15) == 0) {
+            trace_replay(argv[i] + 15);
+            return EXIT_SUCCESS;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        } else file_path = argv[i];
+    }
+
+    if (socket_path != NULL) {
+        daemon_serve(socket_path, workers);
+        return EXIT_SUCCESS;
+    }
+
+    GScope *gscope = NULL;
+
+    if (load_image_path != NULL) {
+        // compiled when the image was saved
+        gscope = image_load(load_image_path);
+    } else {
+        char *buffer = read_content_from_file(file_path);
+        Module *mod = lex_buffer_parallel(buffer, file_path, lex_threads);
 
 #ifdef DEBUG
 
-    printf(">>>>>>> [LEX WORK]\n");
-    mod_log(mod);
-    printf("=========================================================\n");
+        printf(">>>>>>> [LEX WORK]\n");
+        mod_log(mod);
+        printf("=========================================================\n");
 
 #endif // DEBUG
 
-    GScope *gscope = gscope_create(GSCOPE_ROUTINES_INITIAL_CAPACITY, GSCOPE_VARIABLES_INITIAL_CAPACITY);
-    
-    scan_modules(gscope, mod);
+        gscope = gscope_create(GSCOPE_ROUTINES_INITIAL_CAPACITY, GSCOPE_VARIABLES_INITIAL_CAPACITY);
+
+        gscope->inline_threshold = inline_threshold;
+
+        scan_modules(gscope, mod);
+        mem_free(buffer);
+
+        char *entries[] = {entry, init};
+        if (dce) gscope_eliminate_dead_code(gscope, entries, init != NULL ? 2 : 1);
+        gscope_mark_rebound_variables(gscope);
+    }
+
+    int main_rte = gscope_search_routine(gscope, entry);
+    if (main_rte == -1) {
+        fprintf(stderr, ERR_PREFIX"Entry point has not been declared: '%s'\n", ERR_EXP, entry);
+        exit(EXIT_FAILURE);
+    }
+
+    int init_rte = init != NULL ? gscope_search_routine(gscope, init) : -1;
+    if (init != NULL && init_rte == -1) {
+        fprintf(stderr, ERR_PREFIX"Init routine has not been declared: '%s'\n", ERR_EXP, init);
+        exit(EXIT_FAILURE);
+    }
+
+    // in lazy mode the other routines are compiled by their first call,
+    // images hold all of them compiled
+    if (load_image_path == NULL) {
+        if (lazy && save_image_path == NULL) rte_compile(gscope, gscope->routines[main_rte]);
+        else gscope_compile_routines(gscope);
+    }
+
+    tasks_prepare(gscope, task_workers);
+
 #ifdef DEBUG
     printf(">>>>>>> [VARIABLES]\n");
     gscope_log_variables(gscope);
@@ -95,9 +267,47 @@ int main()
     printf("=========================================================\n");
 #endif // DEBUG
 
+    // names used by the tracer and the profiler to report routines
+    char **routine_ids = mem_calloc(MEM_SCOPE, gscope->rte_count, sizeof(*routine_ids));
+    for (size_t j = 0; j < gscope->rte_count; ++j)
+        routine_ids[j] = gscope->routines[j]->id;
+
+    if (trace_capacity > 0) {
+        trace_enable(trace_capacity);
+        if (trace_file_path != NULL) trace_open_file(trace_file_path);
+        trace_set_routines(routine_ids, gscope->rte_count, gscope->mod);
+    }
+
+    if (profile_path != NULL) {
+        profile_set_routines(routine_ids, gscope->rte_count);
+        profile_start(profile_path, profile_hz);
+    }
+
     Stack *mem = st_create_on_heap(MEM_CAPACITY);
-    size_t main_rte = gscope_search_routine(gscope, "main");
-    rte_execute(gscope->routines[main_rte], mem, gscope);
+    FrameStack *frames = frames_create(MEM_CAPACITY);
+
+    if (init_rte != -1) {
+        rte_execute(gscope->routines[init_rte], mem, frames, gscope);
+        if (mem->count != 0) {
+            fprintf(stderr, ERR_PREFIX"Init routine '%s' leaves %zu values on the stack\n", ERR_EXP, init, mem->count);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (save_image_path != NULL) image_save(gscope, save_image_path);
+    else if (batch) run_batch_from_stdin(gscope->routines[main_rte], gscope);
+    else rte_execute(gscope->routines[main_rte], mem, frames, gscope);
+
+    if (!profile_flush()) exit(EXIT_FAILURE);
+    tracer.clean_exit = true;
+    trace_set_routines(NULL, 0, NULL);
+    mem_free(routine_ids);
+
+    frames_destroy(frames);
+    st_destroy_from_heap(mem);
+    scheduler_stop();
+    input_release();
+    gscope_destroy(gscope);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,198 @@
+#ifndef MEMSTATS_H_
+#define MEMSTATS_H_
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+// every allocation of the interpreter goes through these wrappers and is
+// accounted to the subsystem that owns it
+
+typedef enum {
+    MEM_LEXER,
+    MEM_SCOPE,
+    MEM_STACK,
+    MEM_VALUES,
+    MEM_IOTA,
+} MemSubsystem;
+
+char *mem_subsystem_tostr(MemSubsystem sub)
+{
+    switch (sub) {
+        case MEM_LEXER:
+            return "lexer";
+            break;
+        case MEM_SCOPE:
+            return "scope";
+            break;
+        case MEM_STACK:
+            return "data stack";
+            break;
+        case MEM_VALUES:
+            return "values";
+            break;
+        default:
+            assert(0 && "Missing one or multiple MemSubsystem in enum");
+            break;
+    }
+}
+
+typedef struct {
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+    size_t live_blocks;
+    size_t live_bytes;
+    size_t peak_bytes;
+} MemStats;
+
+MemStats mem_stats[MEM_IOTA];
+
+// prepended to every block, keeps the size for accounting on free/realloc
+typedef union {
+    struct {
+        size_t size;
+        MemSubsystem sub;
+    };
+    max_align_t align;
+} MemHeader;
+
+// Counters are kept per thread, so threads allocating at the same time (the
+// parallel lexer) don't fight over the same cache lines, and are merged into
+// mem_stats by mem_stats_flush(). Blocks freed by another thread than the one
+// that allocated them make the local live counters wrap, the merged sums are
+// still exact. Peak is exact for a single thread, approximate across threads
+
+_Thread_local MemStats mem_local_stats[MEM_IOTA];
+
+void mem_account_alloc(MemSubsystem sub, size_t size)
+{
+    MemStats *stats = &mem_local_stats[sub];
+    stats->allocs++;
+    stats->bytes += size;
+    stats->live_blocks++;
+    stats->live_bytes += size;
+    if ((ptrdiff_t) stats->live_bytes > (ptrdiff_t) stats->peak_bytes) stats->peak_bytes = stats->live_bytes;
+}
+
+void mem_account_free(MemSubsystem sub, size_t size)
+{
+    MemStats *stats = &mem_local_stats[sub];
+    stats->frees++;
+    stats->live_blocks--;
+    stats->live_bytes -= size;
+}
+
+void mem_stats_flush(void)
+{
+    // every thread calls this before exiting
+    for (int sub = 0; sub < MEM_IOTA; ++sub) {
+        MemStats *local = &mem_local_stats[sub];
+        MemStats *stats = &mem_stats[sub];
+
+        __atomic_fetch_add(&stats->allocs, local->allocs, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->frees, local->frees, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->bytes, local->bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats->live_blocks, local->live_blocks, __ATOMIC_RELAXED);
+        size_t live = __atomic_add_fetch(&stats->live_bytes, local->live_bytes, __ATOMIC_RELAXED);
+
+        size_t candidate = live > local->peak_bytes ? live : local->peak_bytes;
+        size_t peak = __atomic_load_n(&stats->peak_bytes, __ATOMIC_RELAXED);
+        while (candidate > peak && !__atomic_compare_exchange_n(&stats->peak_bytes, &peak, candidate, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        // live counters restart from the amount now accounted globally
+        *local = (MemStats) {0};
+    }
+}
+
+void *mem_alloc(MemSubsystem sub, size_t size)
+{
+    MemHeader *header = malloc(sizeof(MemHeader) + size);
+    if (header == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+
+    header->size = size;
+    header->sub = sub;
+    mem_account_alloc(sub, size);
+    return header + 1;
+}
+
+void *mem_calloc(MemSubsystem sub, size_t count, size_t size)
+{
+    void *ptr = mem_alloc(sub, count*size);
+    memset(ptr, 0, count*size);
+    return ptr;
+}
+
+void *mem_realloc(MemSubsystem sub, void *ptr, size_t size)
+{
+    if (ptr == NULL) return mem_alloc(sub, size);
+
+    MemHeader *header = (MemHeader *) ptr - 1;
+    mem_account_free(header->sub, header->size);
+
+    header = realloc(header, sizeof(MemHeader) + size);
+    if (header == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+
+    header->size = size;
+    header->sub = sub;
+    mem_account_alloc(sub, size);
+    return header + 1;
+}
+
+char *mem_strdup(MemSubsystem sub, const char *txt)
+{
+    size_t size = strlen(txt)+1;
+    char *copy = mem_alloc(sub, size);
+    memcpy(copy, txt, size);
+    return copy;
+}
+
+void mem_free(void *ptr)
+{
+    if (ptr == NULL) return;
+
+    MemHeader *header = (MemHeader *) ptr - 1;
+    mem_account_free(header->sub, header->size);
+    free(header);
+}
+
+void mem_report(FILE *stream)
+{
+    MemStats total = {0};
+    mem_stats_flush();
+
+    fprintf(stream, "%-12s %10s %10s %14s %14s %12s %14s\n",
+            "SUBSYSTEM", "ALLOCS", "FREES", "BYTES", "PEAK BYTES", "LEAKED", "LEAKED BYTES");
+
+    for (int sub = 0; sub < MEM_IOTA; ++sub) {
+        MemStats *stats = &mem_stats[sub];
+        fprintf(stream, "%-12s %10zu %10zu %14zu %14zu %12zu %14zu\n",
+                mem_subsystem_tostr(sub), stats->allocs, stats->frees, stats->bytes,
+                stats->peak_bytes, stats->live_blocks, stats->live_bytes);
+
+        total.allocs += stats->allocs;
+        total.frees += stats->frees;
+        total.bytes += stats->bytes;
+        total.peak_bytes += stats->peak_bytes;
+        total.live_blocks += stats->live_blocks;
+        total.live_bytes += stats->live_bytes;
+    }
+
+    // sum of per subsystem peaks, an upper bound of the real peak
+    fprintf(stream, "%-12s %10zu %10zu %14zu %14zu %12zu %14zu\n",
+            "total", total.allocs, total.frees, total.bytes,
+            total.peak_bytes, total.live_blocks, total.live_bytes);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(stream, "peak resident set size: %ld KiB\n", usage.ru_maxrss);
+}
+
+#endif  // MEMSTATS_H_
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#define ERR_PREFIX "ERROR %s:%d: "          // error prefix for file path and line number
+#define ERR_EXP __FILE__, __LINE__    // arguments expansion
+
+#include "pancake.h"
+#include "trap.h"
+#include "stack.h"
+#include "lexer.h"
+#include "interpreter.h"
+#include "tasks.h"
+#include "input.h"
+
+#define PANCAKE_STACK_CAPACITY 16
+
+struct PancakeProgram {
+    GScope *gscope;
+};
+
+struct PancakeStack {
+    Stack *mem;
+    FrameStack *frames;
+};
+
+PancakeProgram *pancake_compile(const char *source, const char *name)
+{
+    // whatever was built when an error jumps back is released, the gscope
+    // owns the module once scanning started
+    char *volatile buffer = NULL;
+    Module *volatile mod = NULL;
+    GScope *volatile gscope = NULL;
+
+    jmp_buf trap;
+    jmp_buf *outer = rte_trap;
+    rte_trap = &trap;
+
+    if (setjmp(trap) != 0) {
+        rte_trap = outer;
+        if (buffer != NULL) mem_free(buffer);
+        if (gscope != NULL) {
+            gscope->mod = mod;
+            gscope_destroy(gscope);
+        } else if (mod != NULL) mod_destroy(mod);
+        return NULL;
+    }
+
+    buffer = mem_strdup(MEM_LEXER, source);
+    mod = mod_create((char *) name, MODULE_INITIAL_CAPACITY);
+    lex_range(mod, buffer, 0, strlen(buffer), 1);
+
+    gscope = gscope_create(GSCOPE_ROUTINES_INITIAL_CAPACITY, GSCOPE_VARIABLES_INITIAL_CAPACITY);
+    scan_modules(gscope, mod);
+    mem_free(buffer);
+    buffer = NULL;
+
+    // every routine may be called, compile them all now so calls never
+    // modify the program
+    gscope_mark_rebound_variables(gscope);
+    gscope_compile_routines(gscope);
+    tasks_prepare(gscope, 0);
+
+    PancakeProgram *program = mem_alloc(MEM_SCOPE, sizeof(PancakeProgram));
+    program->gscope = gscope;
+
+    rte_trap = outer;
+    return program;
+}
+
+void pancake_program_free(PancakeProgram *program)
+{
+    if (program == NULL) return;
+    gscope_destroy(program->gscope);
+    mem_free(program);
+}
+
+PancakeStatus pancake_call(PancakeProgram *program, const char *routine, PancakeStack *stack)
+{
+    int rte_j = gscope_search_routine(program->gscope, (char *) routine);
+    if (rte_j == -1) {
+        fprintf(stderr, ERR_PREFIX"Routine has not been declared: '%s'\n", ERR_EXP, routine);
+        return PANCAKE_ERROR;
+    }
+
+    jmp_buf trap;
+    jmp_buf *outer = rte_trap;
+    rte_trap = &trap;
+
+    if (setjmp(trap) != 0) {
+        // frames of the calls that were running are released
+        frames_leave(stack->frames, 0);
+        rte_trap = outer;
+        return PANCAKE_ERROR;
+    }
+
+    rte_execute(program->gscope->routines[rte_j], stack->mem, stack->frames, program->gscope);
+
+    rte_trap = outer;
+    return PANCAKE_OK;
+}
+
+PancakeStack *pancake_stack_create(void)
+{
+    PancakeStack *stack = mem_alloc(MEM_STACK, sizeof(PancakeStack));
+    stack->mem = st_create_on_heap(PANCAKE_STACK_CAPACITY);
+    stack->frames = frames_create(PANCAKE_STACK_CAPACITY);
+    return stack;
+}
+
+void pancake_stack_free(PancakeStack *stack)
+{
+    if (stack == NULL) return;
+    st_destroy_from_heap(stack->mem);
+    frames_destroy(stack->frames);
+    mem_free(stack);
+}
+
+void pancake_stack_clear(PancakeStack *stack)
+{
+    while (stack->mem->count > 0) st_pop(stack->mem);
+}
+
+size_t pancake_stack_depth(PancakeStack *stack)
+{
+    return stack->mem->count;
+}
+
+void pancake_push_int(PancakeStack *stack, long integer)
+{
+    st_push(stack->mem, value_create_int(integer));
+}
+
+void pancake_push_float(PancakeStack *stack, double real)
+{
+    st_push(stack->mem, value_create_float(real));
+}
+
+void pancake_push_bool(PancakeStack *stack, bool boolean)
+{
+    st_push(stack->mem, value_create_bool(boolean));
+}
+
+void pancake_push_string(PancakeStack *stack, const char *txt)
+{
+    st_push(stack->mem, value_create_string((char *) txt));
+}
+
+Value *pancake_peek(PancakeStack *stack, size_t n, ValueType vtype)
+{
+    // NULL when there is no such value or it has another type
+    if (n >= stack->mem->count) return NULL;
+
+    Value *value = st_peek(stack->mem, n);
+    return value->type == vtype ? value : NULL;
+}
+
+PancakeType pancake_type(PancakeStack *stack, size_t n)
+{
+    if (n >= stack->mem->count) return PANCAKE_NONE;
+
+    switch (st_peek(stack->mem, n)->type) {
+        case VT_STRING: return PANCAKE_STRING;
+        case VT_INT: return PANCAKE_INT;
+        case VT_FLOAT: return PANCAKE_FLOAT;
+        case VT_BOOL: return PANCAKE_BOOL;
+        default: return PANCAKE_NONE;
+    }
+}
+
+long pancake_get_int(PancakeStack *stack, size_t n)
+{
+    Value *value = pancake_peek(stack, n, VT_INT);
+    return value != NULL ? value->integer : 0;
+}
+
+double pancake_get_float(PancakeStack *stack, size_t n)
+{
+    Value *value = pancake_peek(stack, n, VT_FLOAT);
+    return value != NULL ? value->real : 0;
+}
+
+bool pancake_get_bool(PancakeStack *stack, size_t n)
+{
+    Value *value = pancake_peek(stack, n, VT_BOOL);
+    return value != NULL ? value->boolean : false;
+}
+
+const char *pancake_get_string(PancakeStack *stack, size_t n)
+{
+    // slices are not terminated, they get a copy that is
+    Value *value = pancake_peek(stack, n, VT_STRING);
+    if (value == NULL) return NULL;
+    value_materialize(value);
+    return value->txt;
+}
+
+void pancake_pop(PancakeStack *stack)
+{
+    if (stack->mem->count > 0) st_pop(stack->mem);
+}
@@ -0,0 +1,60 @@
+#ifndef PANCAKE_H_
+#define PANCAKE_H_
+#include <stdbool.h>
+#include <stddef.h>
+
+// Embedding API of libpancake: a source is compiled once into a program, its
+// routines can then be called any number of times on stacks owned by the
+// host. Errors of the interpreter are reported on stderr and returned as
+// PANCAKE_ERROR instead of terminating the process.
+//
+// A program keeps the global variables of its source, so calls that bind
+// them must not run on the same program at the same time. Independent
+// programs can be used from different threads
+
+#define PANCAKE_API __attribute__((visibility("default")))
+
+typedef struct PancakeProgram PancakeProgram;
+typedef struct PancakeStack PancakeStack;
+
+typedef enum {
+    PANCAKE_OK,
+    PANCAKE_ERROR,
+} PancakeStatus;
+
+typedef enum {
+    PANCAKE_NONE,
+    PANCAKE_STRING,
+    PANCAKE_INT,
+    PANCAKE_FLOAT,
+    PANCAKE_BOOL,
+} PancakeType;
+
+// lex, scan and compile source, name is used in error messages. Returns NULL
+// when the source has errors
+PANCAKE_API PancakeProgram *pancake_compile(const char *source, const char *name);
+PANCAKE_API void pancake_program_free(PancakeProgram *program);
+
+// run routine on stack, arguments are taken from it and results are left on it
+PANCAKE_API PancakeStatus pancake_call(PancakeProgram *program, const char *routine, PancakeStack *stack);
+
+PANCAKE_API PancakeStack *pancake_stack_create(void);
+PANCAKE_API void pancake_stack_free(PancakeStack *stack);
+PANCAKE_API void pancake_stack_clear(PancakeStack *stack);
+PANCAKE_API size_t pancake_stack_depth(PancakeStack *stack);
+
+PANCAKE_API void pancake_push_int(PancakeStack *stack, long integer);
+PANCAKE_API void pancake_push_float(PancakeStack *stack, double real);
+PANCAKE_API void pancake_push_bool(PancakeStack *stack, bool boolean);
+PANCAKE_API void pancake_push_string(PancakeStack *stack, const char *txt);
+
+// n counts from the top of the stack, 0 is the last pushed value. Getters
+// return 0, false or NULL when the value has another type
+PANCAKE_API PancakeType pancake_type(PancakeStack *stack, size_t n);
+PANCAKE_API long pancake_get_int(PancakeStack *stack, size_t n);
+PANCAKE_API double pancake_get_float(PancakeStack *stack, size_t n);
+PANCAKE_API bool pancake_get_bool(PancakeStack *stack, size_t n);
+PANCAKE_API const char *pancake_get_string(PancakeStack *stack, size_t n);
+PANCAKE_API void pancake_pop(PancakeStack *stack);
+
+#endif  // PANCAKE_H_
@@ -0,0 +1,200 @@
+#ifndef PROFILER_H_
+#define PROFILER_H_
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Sampling profiler: a SIGPROF timer periodically snapshots the chain of
+// Pancake routines being executed (not the C stack) and at exit the samples
+// are written as folded stacks, one "main;caller;callee count" per line,
+// ready to be fed to flamegraph tooling
+
+#define PROFILE_DEFAULT_HZ 997
+#define PROFILE_MAX_DEPTH 128
+#define PROFILE_BUFFER_WORDS (1 << 22)
+
+typedef struct {
+    uint32_t frames[PROFILE_MAX_DEPTH];
+    volatile sig_atomic_t depth;
+} CallStack;
+
+// every thread executes its own routines, SIGPROF is delivered to the thread
+// that consumed the cpu time so the handler samples the right chain
+_Thread_local CallStack call_stack;
+
+typedef struct {
+    bool enabled;
+
+    // samples are stored back to back as [depth, frame0, frame1, ...]
+    uint32_t *buffer;
+    _Atomic size_t used;
+    _Atomic size_t dropped;
+
+    char **routine_ids;
+    size_t rte_count;
+
+    char *file_path;
+    bool written;
+} Profiler;
+
+Profiler profiler = {0};
+
+#define PROFILE_ENTER(routine_index)                                        \
+do {                                                                        \
+    if (__builtin_expect(profiler.enabled, 0)) {                            \
+        if (call_stack.depth < PROFILE_MAX_DEPTH)                           \
+            call_stack.frames[call_stack.depth] = (uint32_t) (routine_index); \
+        atomic_signal_fence(memory_order_release);                          \
+        call_stack.depth++;                                                 \
+    }                                                                       \
+} while (0)
+
+#define PROFILE_LEAVE()                                                     \
+do {                                                                        \
+    if (__builtin_expect(profiler.enabled, 0)) call_stack.depth--;          \
+} while (0)
+
+void profile_signal_handler(int signum)
+{
+    (void) signum;
+
+    size_t depth = call_stack.depth;
+    if (depth == 0) return;
+    if (depth > PROFILE_MAX_DEPTH) depth = PROFILE_MAX_DEPTH;
+
+    size_t at = atomic_fetch_add_explicit(&profiler.used, depth+1, memory_order_relaxed);
+    if (at + depth + 1 > PROFILE_BUFFER_WORDS) {
+        atomic_fetch_add_explicit(&profiler.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    profiler.buffer[at] = (uint32_t) depth;
+    memcpy(profiler.buffer + at + 1, call_stack.frames, depth*sizeof(uint32_t));
+}
+
+int profile_sample_compare(const void *a, const void *b)
+{
+    const uint32_t *x = *(const uint32_t **) a;
+    const uint32_t *y = *(const uint32_t **) b;
+
+    size_t depth = x[0] < y[0] ? x[0] : y[0];
+    for (size_t k = 1; k <= depth; ++k) {
+        if (x[k] != y[k]) return x[k] < y[k] ? -1 : 1;
+    }
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+void profile_write_folded(FILE *stream, uint32_t **samples, size_t sample_count)
+{
+    // identical stacks are adjacent once sorted, print each with its count
+    qsort(samples, sample_count, sizeof(*samples), profile_sample_compare);
+
+    size_t k = 0;
+    while (k < sample_count) {
+        size_t run = 1;
+        while (k + run < sample_count && profile_sample_compare(&samples[k], &samples[k+run]) == 0) run++;
+
+        uint32_t *sample = samples[k];
+        for (uint32_t f = 1; f <= sample[0]; ++f) {
+            if (f > 1) fputc(';', stream);
+            if (sample[f] < profiler.rte_count) fputs(profiler.routine_ids[sample[f]], stream);
+            else fputs("?", stream);
+        }
+        fprintf(stream, " %zu\n", run);
+        k += run;
+    }
+}
+
+bool profile_flush(void)
+{
+    // writes the samples once, false when they could not be written
+    if (!profiler.enabled || profiler.written) return true;
+    profiler.written = true;
+
+    // disarm the timer before reading the samples
+    struct itimerval timer = {0};
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    size_t used = atomic_load(&profiler.used);
+    if (used > PROFILE_BUFFER_WORDS) used = PROFILE_BUFFER_WORDS;
+
+    size_t sample_count = 0;
+    for (size_t at = 0; at < used && profiler.buffer[at] != 0; at += profiler.buffer[at]+1)
+        sample_count++;
+
+    uint32_t **samples = calloc(sample_count+1, sizeof(*samples));
+    if (samples == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
+        return false;
+    }
+
+    size_t s = 0;
+    for (size_t at = 0; s < sample_count; at += profiler.buffer[at]+1)
+        samples[s++] = profiler.buffer + at;
+
+    FILE *stream = fopen(profiler.file_path, "w");
+    if (stream == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not open file: %s\n", ERR_EXP, profiler.file_path);
+        free(samples);
+        return false;
+    }
+    profile_write_folded(stream, samples, sample_count);
+    fclose(stream);
+
+    size_t dropped = atomic_load(&profiler.dropped);
+    if (dropped > 0)
+        fprintf(stderr, "WARNING: profiler buffer full, %zu samples dropped\n", dropped);
+
+    free(samples);
+    return true;
+}
+
+void profile_stop(void)
+{
+    // runs as an atexit handler, calling exit from here is undefined so a
+    // failure is only reported
+    profile_flush();
+}
+
+void profile_start(char *file_path, unsigned hz)
+{
+    profiler.buffer = calloc(PROFILE_BUFFER_WORDS, sizeof(*profiler.buffer));
+    if (profiler.buffer == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+    profiler.file_path = file_path;
+    profiler.enabled = true;
+
+    struct sigaction action = {0};
+    action.sa_handler = profile_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    // samples are written on error exits as well
+    atexit(profile_stop);
+
+    if (hz == 0) hz = PROFILE_DEFAULT_HZ;
+    long interval = 1000000/hz;
+    if (interval == 0) interval = 1;
+
+    struct itimerval timer = {0};
+    timer.it_interval.tv_usec = interval;
+    timer.it_value.tv_usec = interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void profile_set_routines(char **routine_ids, size_t rte_count)
+{
+    profiler.routine_ids = routine_ids;
+    profiler.rte_count = rte_count;
+}
+
+#endif  // PROFILER_H_
@@ -0,0 +1,171 @@
+#ifndef SCAN_H_
+#define SCAN_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte scanning primitives used by the lexer on its hot paths: skipping
+// whitespace, finding the end of a comment and the closing quote of a string.
+// SSE2 is the baseline on x86, AVX2 is picked at runtime when available,
+// other architectures use the scalar loops
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+typedef enum {
+    CC_SPACE   = 1 << 0,
+    CC_NEWLINE = 1 << 1,
+    CC_ALPHA   = 1 << 2,
+    CC_DIGIT   = 1 << 3,
+    CC_IDENT   = 1 << 4,
+} CharClass;
+
+static const uint8_t char_class[256] = {
+    [' ']  = CC_SPACE,
+    ['\t'] = CC_SPACE,
+    ['\v'] = CC_SPACE,
+    ['\f'] = CC_SPACE,
+    ['\r'] = CC_SPACE,
+    ['\n'] = CC_SPACE | CC_NEWLINE,
+    ['a' ... 'z'] = CC_ALPHA | CC_IDENT,
+    ['A' ... 'Z'] = CC_ALPHA | CC_IDENT,
+    ['0' ... '9'] = CC_DIGIT | CC_IDENT,
+    ['-']  = CC_IDENT,
+};
+
+#define CHAR_IS(c, cls) ((char_class[(uint8_t) (c)] & (cls)) != 0)
+
+#ifdef SCAN_SIMD
+
+int scan_avx2_state = -1;
+
+bool scan_has_avx2(void)
+{
+    // lexer threads may race to fill it in, they all store the same value
+    int state = __atomic_load_n(&scan_avx2_state, __ATOMIC_RELAXED);
+    if (state == -1) {
+        state = __builtin_cpu_supports("avx2") ? 1 : 0;
+        __atomic_store_n(&scan_avx2_state, state, __ATOMIC_RELAXED);
+    }
+    return state;
+}
+
+static inline uint32_t scan_eq_mask16(const char *p, char byte)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(byte)));
+}
+
+static inline uint32_t scan_space_mask16(const char *p)
+{
+    // ' ' or '\t'..'\r', bytes above 127 are negative and never match
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i space = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    __m128i ctrl = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                 _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1)));
+    return (uint32_t) _mm_movemask_epi8(_mm_or_si128(space, ctrl));
+}
+
+__attribute__((target("avx2")))
+size_t scan_find_byte_avx2(const char *buf, size_t c, size_t size, char byte)
+{
+    __m256i needle = _mm256_set1_epi8(byte);
+    while (c + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + c));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask) return c + __builtin_ctz(mask);
+        c += 32;
+    }
+    return c;
+}
+
+__attribute__((target("avx2")))
+size_t scan_skip_space_avx2(const char *buf, size_t c, size_t size, size_t *row, size_t *line_start)
+{
+    while (c + 32 <= size) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + c));
+        __m256i space = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+        __m256i ctrl = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('\t' - 1)),
+                                        _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), v));
+        uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(_mm256_or_si256(space, ctrl));
+        uint32_t nl = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+
+        // only newlines before the first non space byte count
+        if (stop) nl &= (1u << __builtin_ctz(stop)) - 1;
+        if (nl) {
+            *row += __builtin_popcount(nl);
+            *line_start = c + 32 - __builtin_clz(nl);
+        }
+        if (stop) return c + __builtin_ctz(stop);
+        c += 32;
+    }
+    return c;
+}
+
+#endif  // SCAN_SIMD
+
+size_t scan_find_byte(const char *buf, size_t c, size_t size, char byte)
+{
+    // index of the first occurrence of byte at or after c, size if missing
+#ifdef SCAN_SIMD
+    if (scan_has_avx2()) {
+        c = scan_find_byte_avx2(buf, c, size, byte);
+        if (c < size && buf[c] == byte) return c;
+    }
+
+    while (c + 16 <= size) {
+        uint32_t mask = scan_eq_mask16(buf + c, byte);
+        if (mask) return c + __builtin_ctz(mask);
+        c += 16;
+    }
+#endif
+
+    while (c < size && buf[c] != byte) c++;
+    return c;
+}
+
+size_t scan_skip_space(const char *buf, size_t c, size_t size, size_t *row, size_t *line_start)
+{
+    // most tokens are separated by a single space, don't bother with vectors
+    if (c < size && !CHAR_IS(buf[c], CC_SPACE)) return c;
+
+#ifdef SCAN_SIMD
+    if (scan_has_avx2()) c = scan_skip_space_avx2(buf, c, size, row, line_start);
+
+    while (c + 16 <= size) {
+        uint32_t stop = ~scan_space_mask16(buf + c) & 0xFFFF;
+        uint32_t nl = scan_eq_mask16(buf + c, '\n');
+
+        if (stop) nl &= (1u << __builtin_ctz(stop)) - 1;
+        if (nl) {
+            *row += __builtin_popcount(nl);
+            *line_start = c + 32 - __builtin_clz(nl);
+        }
+        if (stop) return c + __builtin_ctz(stop);
+        c += 16;
+    }
+#endif
+
+    while (c < size && CHAR_IS(buf[c], CC_SPACE)) {
+        if (buf[c] == '\n') {
+            (*row)++;
+            *line_start = c+1;
+        }
+        c++;
+    }
+    return c;
+}
+
+size_t scan_find_string_end(const char *buf, size_t c, size_t size)
+{
+    // closing double quotes, skipping the escaped ones
+    for (;;) {
+        c = scan_find_byte(buf, c, size, '"');
+        if (c == size || buf[c-1] != '\\') return c;
+        c++;
+    }
+}
+
+#endif  // SCAN_H_
@@ -1,15 +1,24 @@
 #ifndef STACK_H_
 #define STACK_H_
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "format.h"
+#include "memstats.h"
+
 #define DEFAULT_STACK_INITIAL_CAPACITY 16
 
-typedef enum {
+// one byte, so strings fit their offset in a 24 bytes Value
+typedef enum __attribute__((packed)) {
     VT_UNKNOWN,
     VT_STRING,
     VT_INT,
     VT_FLOAT,
     VT_BOOL,
+    VT_TASK,
+    VT_ARRAY,
+    VT_TABLE,
     VT_IOTA,
 } ValueType;
 
@@ -28,6 +37,15 @@ char *vtype_tostr(ValueType vtype)
         case VT_BOOL:
             return "VT_BOOL";
             break;
+        case VT_TASK:
+            return "VT_TASK";
+            break;
+        case VT_ARRAY:
+            return "VT_ARRAY";
+            break;
+        case VT_TABLE:
+            return "VT_TABLE";
+            break;
         default:
             assert(0 && "Missing one or multiple ValueType in enum");
             break;
@@ -36,32 +54,329 @@ char *vtype_tostr(ValueType vtype)
 
 char **value_types_enum_str_repr;
 
+// spawned routine, defined by tasks.h
+struct Task;
+void task_release(struct Task *task);
+
+struct Array;
+
+// hash map, defined by table.h
+struct Table;
+void table_print(struct Table *table);
+void table_release(struct Table *table);
+
+// values are immutable once created (tables aside), so the same value can be
+// shared by several stack slots and variables, each of them holding a reference
 typedef struct {
-    char *txt;
+    union {
+        char *txt;
+        long integer;
+        double real;
+        bool boolean;
+        struct Task *task;
+        struct Array *array;
+        struct Table *table;
+    };
+
+    // txt is len bytes at offset start of the data of a StrBuf, views point
+    // into a buffer owned by someone else instead. Only strings ending where
+    // their buffer is filled are terminated
+    uint32_t len;
+    uint32_t start;
+
+    uint32_t refs;
     ValueType type;
+    bool view;
+
+    // shared values are read by several threads at once (constants of a
+    // program served by the daemon or running tasks), refs stay untouched
+    // until unshared
+    bool shared;
 } Value;
 
-Value *value_create(char *txt, ValueType vtype)
+// characters of strings, shared by the strings sliced or appended from them.
+// data[fill] is always '\0' and a string ending at fill grows in place while
+// there is room, so appending to the same string in a loop copies each byte
+// about twice
+typedef struct {
+    uint32_t refs;
+    size_t fill;
+    size_t capacity;
+    char data[];
+} StrBuf;
+
+// arrays are immutable like every other value, items hold a reference each
+typedef struct Array {
+    size_t count;
+    Value *items[];
+} Array;
+
+// set before the first task runs, from then on values may be reached from
+// several threads and refs are counted atomically. It is never cleared
+bool values_atomic = false;
+
+#define VALUES_ATOMIC() __builtin_expect(__atomic_load_n(&values_atomic, __ATOMIC_RELAXED), 0)
+
+Value *value_alloc(ValueType vtype)
+{
+    Value *value = mem_alloc(MEM_VALUES, sizeof(Value));
+
+    value->type = vtype;
+    value->len = 0;
+    value->start = 0;
+    value->view = false;
+    value->shared = false;
+    value->refs = 1;
+    return value;
+}
+
+void string_check_len(size_t len)
+{
+    if (len > UINT32_MAX) {
+        fprintf(stderr, ERR_PREFIX"String of %zu bytes is too long\n", ERR_EXP, len);
+        exit(EXIT_FAILURE);
+    }
+}
+
+StrBuf *strbuf_create(size_t fill, size_t capacity)
+{
+    // capacity counts the terminator, data[0..fill) is left to the caller
+    assert(fill < capacity);
+
+    StrBuf *buf = mem_alloc(MEM_VALUES, sizeof(StrBuf) + capacity);
+    buf->refs = 1;
+    buf->fill = fill;
+    buf->capacity = capacity;
+    buf->data[fill] = '\0';
+    return buf;
+}
+
+StrBuf *strbuf_of(Value *value)
+{
+    return (StrBuf *) (value->txt - value->start - offsetof(StrBuf, data));
+}
+
+void strbuf_ref(StrBuf *buf)
 {
-    Value *value = malloc(sizeof(ValueType));
+    if (VALUES_ATOMIC()) __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    else buf->refs++;
+}
+
+void strbuf_unref(StrBuf *buf)
+{
+    uint32_t refs = VALUES_ATOMIC() ? __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) : --buf->refs;
+    if (refs == 0) mem_free(buf);
+}
+
+Value *value_create_strbuf(StrBuf *buf, size_t start, size_t len)
+{
+    // takes over a reference to buf
+    Value *value = value_alloc(VT_STRING);
+    value->txt = buf->data + start;
+    value->start = (uint32_t) start;
+    value->len = (uint32_t) len;
+    return value;
+}
+
+Value *value_create_view(const char *txt, size_t len)
+{
+    // the text must outlive the value, see value_materialize
+    string_check_len(len);
+
+    Value *value = value_alloc(VT_STRING);
+    value->txt = (char *) txt;
+    value->len = (uint32_t) len;
+    value->view = true;
+    return value;
+}
+
+void value_materialize(Value *value)
+{
+    // views and strings that are not terminated get a buffer of their own
+    if (!value->view && value->txt[value->len] == '\0') return;
+
+    StrBuf *buf = strbuf_create(value->len, (size_t) value->len + 1);
+    memcpy(buf->data, value->txt, value->len);
+    if (!value->view) strbuf_unref(strbuf_of(value));
+
+    value->txt = buf->data;
+    value->start = 0;
+    value->view = false;
+}
 
+Value *value_create_string_len(const char *txt, size_t len)
+{
+    string_check_len(len);
+
+    StrBuf *buf = strbuf_create(len, len + 1);
+    memcpy(buf->data, txt, len);
+    return value_create_strbuf(buf, 0, len);
+}
+
+Value *value_create_string(char *txt)
+{
     // this funciton manage memory on its own
-    value->txt = malloc(strlen(txt));
-    strcpy(value->txt, txt);
+    return value_create_string_len(txt, strlen(txt));
+}
 
-    value->type = vtype;
+Value *value_create_int(long integer)
+{
+    Value *value = value_alloc(VT_INT);
+    value->integer = integer;
+    return value;
+}
+
+Value *value_create_float(double real)
+{
+    Value *value = value_alloc(VT_FLOAT);
+    value->real = real;
+    return value;
+}
+
+Value *value_create_bool(bool boolean)
+{
+    Value *value = value_alloc(VT_BOOL);
+    value->boolean = boolean;
+    return value;
+}
+
+Value *value_create_task(struct Task *task)
+{
+    Value *value = value_alloc(VT_TASK);
+    value->task = task;
+    return value;
+}
+
+Value *value_create_array(size_t count)
+{
+    // items start NULL, the caller fills all of them
+    Value *value = value_alloc(VT_ARRAY);
+    value->array = mem_calloc(MEM_VALUES, 1, sizeof(Array) + count*sizeof(Value *));
+    value->array->count = count;
+    return value;
+}
+
+Value *value_create(char *txt, ValueType vtype)
+{
+    // build a value from the text of a literal, numbers and bools are parsed
+    // once here and kept in native form from now on
+    switch (vtype) {
+        case VT_STRING: return value_create_string(txt);
+        case VT_INT: return value_create_int(strtol(txt, NULL, 10));
+        case VT_FLOAT: return value_create_float(strtod(txt, NULL));
+        case VT_BOOL: return value_create_bool(strcmp(txt, "true") == 0);
+        default:
+            assert(0 && "Unreachable");
+            return NULL;
+    }
+}
+
+bool value_is_number(Value *value)
+{
+    return value->type == VT_INT || value->type == VT_FLOAT;
+}
+
+double value_as_real(Value *value)
+{
+    return value->type == VT_INT ? (double) value->integer : value->real;
+}
+
+size_t value_format(char *buf, Value *value)
+{
+    // buf must be at least FMT_NUMBER_MAX_SIZE bytes, strings are not copied
+    switch (value->type) {
+        case VT_INT: return fmt_int(buf, value->integer);
+        case VT_FLOAT: return fmt_float(buf, value->real);
+        case VT_BOOL: {
+            const char *txt = value->boolean ? "true" : "false";
+            strcpy(buf, txt);
+            return strlen(txt);
+        }
+        default:
+            assert(0 && "Unreachable");
+            return 0;
+    }
+}
+
+// output of the program, daemon workers capture it per request
+_Thread_local FILE *rte_out = NULL;
+
+FILE *rte_output(void)
+{
+    return rte_out != NULL ? rte_out : stdout;
+}
+
+void value_print(Value *value)
+{
+    if (value->type == VT_STRING) {
+        fwrite(value->txt, 1, value->len, rte_output());
+        return;
+    }
+
+    if (value->type == VT_TASK) {
+        fputs("<task>", rte_output());
+        return;
+    }
+
+    if (value->type == VT_ARRAY) {
+        fputs("{", rte_output());
+        for (size_t k = 0; k < value->array->count; ++k) {
+            if (k > 0) fputs(", ", rte_output());
+            value_print(value->array->items[k]);
+        }
+        fputs("}", rte_output());
+        return;
+    }
+
+    if (value->type == VT_TABLE) {
+        table_print(value->table);
+        return;
+    }
+
+    char buf[FMT_NUMBER_MAX_SIZE];
+    size_t len = value_format(buf, value);
+    fwrite(buf, 1, len, rte_output());
+}
+
+Value *value_ref(Value *value)
+{
+    if (value->shared) return value;
+
+    if (VALUES_ATOMIC()) __atomic_add_fetch(&value->refs, 1, __ATOMIC_RELAXED);
+    else value->refs++;
     return value;
 }
 
 void value_log(Value *value)
 {
-    printf("(%s) %s\n", vtype_tostr(value->type), value->txt);
+    printf("(%s) ", vtype_tostr(value->type));
+    value_print(value);
+    printf("\n");
 }
 
+void value_unref(Value *value);
+
 void value_destroy(Value *value)
 {
-    free(value->txt);
-    free(value);
+    if (value->type == VT_STRING && !value->view) strbuf_unref(strbuf_of(value));
+    if (value->type == VT_TASK) task_release(value->task);
+    if (value->type == VT_ARRAY) {
+        for (size_t k = 0; k < value->array->count; ++k) {
+            if (value->array->items[k] != NULL) value_unref(value->array->items[k]);
+        }
+        mem_free(value->array);
+    }
+    if (value->type == VT_TABLE) table_release(value->table);
+    mem_free(value);
+}
+
+void value_unref(Value *value)
+{
+    // last reference gone, release the payload
+    if (value->shared) return;
+
+    size_t refs = VALUES_ATOMIC() ? __atomic_sub_fetch(&value->refs, 1, __ATOMIC_ACQ_REL) : --value->refs;
+    if (refs == 0) value_destroy(value);
 }
 
 typedef struct {
@@ -75,30 +390,18 @@ Stack st_create_on_stack(const size_t initial_capacity)
     Stack stack = {0};
     stack.capacity = initial_capacity;
 
-    stack.items = calloc(initial_capacity, sizeof(*stack.items));
-    if (stack.items == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
+    stack.items = mem_calloc(MEM_STACK, initial_capacity, sizeof(*stack.items));
 
     return stack;
 }
 
 Stack *st_create_on_heap(const size_t initial_capacity)
 {
-    Stack *stack = malloc(sizeof(Stack));
-    if (stack == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
+    Stack *stack = mem_alloc(MEM_STACK, sizeof(Stack));
 
     stack->count = 0;
     stack->capacity = initial_capacity;
-    stack->items = calloc(initial_capacity, sizeof(*stack->items));
-    if (stack->items == NULL) {
-        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-        exit(EXIT_FAILURE);
-    }
+    stack->items = mem_calloc(MEM_STACK, initial_capacity, sizeof(*stack->items));
 
     return stack;
 }
@@ -108,16 +411,32 @@ void st_push(Stack *stack, Value *item)
     // if count is equal to capacity reallocate memory using more space
     if (stack->count == stack->capacity) {
         stack->capacity = stack->capacity == 0 ? DEFAULT_STACK_INITIAL_CAPACITY : (stack->capacity*2);
-        stack->items = realloc(stack->items, stack->capacity*sizeof(*stack->items));
-        if (stack->items == NULL) {
-            fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
-            exit(EXIT_FAILURE);
-        }
+        stack->items = mem_realloc(MEM_STACK, stack->items, stack->capacity*sizeof(*stack->items));
     }
 
     stack->items[stack->count++] = item;
 }
 
+Stack *st_create_from_line(char *line, const size_t initial_capacity)
+{
+    // whitespace separated literals, the last one ends up on top
+    Stack *stack = st_create_on_heap(initial_capacity);
+    char *save = NULL;
+
+    for (char *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save)) {
+        char *end = NULL;
+        ValueType vtype = VT_STRING;
+
+        if (strcmp(word, "true") == 0 || strcmp(word, "false") == 0) vtype = VT_BOOL;
+        else if ((strtol(word, &end, 10), *end == '\0')) vtype = VT_INT;
+        else if ((strtod(word, &end), *end == '\0')) vtype = VT_FLOAT;
+
+        st_push(stack, value_create(word, vtype));
+    }
+
+    return stack;
+}
+
 Value *st_peek(Stack *stack, size_t n)
 {
     return stack->items[stack->count-1-n];
@@ -126,17 +445,25 @@ Value *st_peek(Stack *stack, size_t n)
 void st_pop(Stack *stack)
 {
     // this function is intended to be used right after st_peek(st, n) if you
-    // want to get top element before deleting
-    value_destroy(stack->items[stack->count-1]);
+    // want to get top element before deleting, take a reference with
+    // value_ref() to keep it alive after the pop
+    value_unref(stack->items[stack->count-1]);
     stack->count--;
 }
 
+void st_swap(Stack *stack)
+{
+    Value *last = stack->items[stack->count-1];
+    stack->items[stack->count-1] = stack->items[stack->count-2];
+    stack->items[stack->count-2] = last;
+}
+
 void st_destroy_from_stack(Stack *stack)
 {
     // deallocate memory on the heap
     for (size_t i = 0; i < stack->count; ++i)
-        value_destroy(stack->items[i]);
-    free(stack->items);
+        value_unref(stack->items[i]);
+    mem_free(stack->items);
 }
 
 void st_destroy_from_heap(Stack *stack)
@@ -144,7 +471,7 @@ void st_destroy_from_heap(Stack *stack)
     st_destroy_from_stack(stack);
 
     // also deallocate struct
-    free(stack);
+    mem_free(stack);
 }
 
 
@@ -153,13 +480,15 @@ void st_display(Stack *stack)
     if (stack->count != 0) {
         size_t i = 0;
         size_t stack_count = stack->count-1;
-        printf("[");
+        fputs("[", rte_output());
         while (i < stack_count) {
-            printf("%s, ", stack->items[i]->txt);
+            value_print(stack->items[i]);
+            fputs(", ", rte_output());
             i++;
         }
-        printf("%s <-\n", stack->items[i]->txt);
-    } else printf("[ <-\n");
+        value_print(stack->items[i]);
+        fputs(" <-\n", rte_output());
+    } else fputs("[ <-\n", rte_output());
 }
 
 #endif  // STACK_H_
@@ -0,0 +1,380 @@
+#ifndef TABLE_H_
+#define TABLE_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "scan.h"
+#include "stack.h"
+
+// Tables: hash maps from string or int keys to values, the only values that
+// change after being created, every reference sees the same table. Open
+// addressing like swiss tables: each slot has a control byte holding 7 bits
+// of the hash of its key, or marking it empty or deleted, and lookups compare
+// a group of 16 control bytes at once with SSE2, keys are only compared when
+// those bits match. Tables grow to stay at most 7/8 full, deleted slots
+// included. While tasks run each operation holds the lock of the table.
+// A table may be inserted into itself, that's a reference cycle and it's
+// never released
+
+#define TABLE_GROUP 16
+#define TABLE_MINIMUM_CAPACITY 16
+
+#define CTRL_EMPTY ((int8_t) -128)
+#define CTRL_DELETED ((int8_t) -2)
+
+typedef struct {
+    Value *key;
+    Value *value;
+} TableEntry;
+
+typedef struct Table {
+    size_t count;
+    size_t deleted;
+    size_t capacity;
+
+    // capacity control bytes followed by a copy of the first TABLE_GROUP-1,
+    // so a group can be loaded from any slot. Negative bytes are free slots
+    int8_t *ctrl;
+    TableEntry *entries;
+
+    // ctrl and entries belong to an image, they are never freed
+    bool borrowed;
+    int lock;
+} Table;
+
+uint64_t table_mix(uint64_t h)
+{
+    // splitmix64 finalizer
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+uint64_t table_hash(Value *key)
+{
+    if (key->type == VT_INT) return table_mix((uint64_t) key->integer);
+
+    // strings 8 bytes at a time, the tail padded with zeros
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ key->len;
+    size_t c = 0;
+    for (; c + 8 <= key->len; c += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, key->txt + c, 8);
+        h = table_mix(h ^ chunk);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, key->txt + c, key->len - c);
+    return table_mix(h ^ tail);
+}
+
+bool table_key_equal(Value *a, Value *b)
+{
+    if (a->type != b->type) return false;
+    if (a->type == VT_INT) return a->integer == b->integer;
+    return a->len == b->len && memcmp(a->txt, b->txt, a->len) == 0;
+}
+
+static inline uint32_t table_match(const int8_t *ctrl, int8_t byte)
+{
+    // bit k set when ctrl[k] == byte
+#ifdef SCAN_SIMD
+    return scan_eq_mask16((const char *) ctrl, byte);
+#else
+    uint32_t mask = 0;
+    for (int k = 0; k < TABLE_GROUP; ++k) mask |= (uint32_t) (ctrl[k] == byte) << k;
+    return mask;
+#endif
+}
+
+static inline uint32_t table_match_free(const int8_t *ctrl)
+{
+    // empty and deleted slots are the negative ones
+#ifdef SCAN_SIMD
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) ctrl));
+#else
+    uint32_t mask = 0;
+    for (int k = 0; k < TABLE_GROUP; ++k) mask |= (uint32_t) (ctrl[k] < 0) << k;
+    return mask;
+#endif
+}
+
+void table_lock(Table *table)
+{
+    if (!VALUES_ATOMIC()) return;
+    while (__atomic_exchange_n(&table->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&table->lock, __ATOMIC_RELAXED)) {}
+}
+
+void table_unlock(Table *table)
+{
+    if (!VALUES_ATOMIC()) return;
+    __atomic_store_n(&table->lock, 0, __ATOMIC_RELEASE);
+}
+
+void table_set_ctrl(Table *table, size_t slot, int8_t byte)
+{
+    table->ctrl[slot] = byte;
+    if (slot < TABLE_GROUP-1) table->ctrl[table->capacity + slot] = byte;
+}
+
+void table_alloc(Table *table, size_t capacity)
+{
+    // capacity is a power of two, at least a group
+    table->capacity = capacity;
+    table->ctrl = mem_alloc(MEM_VALUES, capacity + TABLE_GROUP-1);
+    memset(table->ctrl, CTRL_EMPTY, capacity + TABLE_GROUP-1);
+    table->entries = mem_calloc(MEM_VALUES, capacity, sizeof(*table->entries));
+    table->borrowed = false;
+}
+
+long table_find(Table *table, Value *key, uint64_t hash)
+{
+    // groups are probed at triangular offsets, which reaches all of them
+    size_t mask = table->capacity - 1;
+    size_t pos = (size_t) (hash >> 7) & mask;
+    int8_t h2 = (int8_t) (hash & 0x7f);
+
+    for (size_t step = TABLE_GROUP;; step += TABLE_GROUP) {
+        const int8_t *group = table->ctrl + pos;
+        for (uint32_t match = table_match(group, h2); match != 0; match &= match - 1) {
+            size_t slot = (pos + __builtin_ctz(match)) & mask;
+            if (table_key_equal(table->entries[slot].key, key)) return (long) slot;
+        }
+
+        // an empty slot ends the chain, the key would have been placed there
+        if (table_match(group, CTRL_EMPTY) != 0) return -1;
+        pos = (pos + step) & mask;
+    }
+}
+
+size_t table_find_free(Table *table, uint64_t hash)
+{
+    size_t mask = table->capacity - 1;
+    size_t pos = (size_t) (hash >> 7) & mask;
+
+    for (size_t step = TABLE_GROUP;; step += TABLE_GROUP) {
+        uint32_t match = table_match_free(table->ctrl + pos);
+        if (match != 0) return (pos + __builtin_ctz(match)) & mask;
+        pos = (pos + step) & mask;
+    }
+}
+
+void table_resize(Table *table)
+{
+    // room for twice the entries, deleted slots are dropped
+    size_t capacity = TABLE_MINIMUM_CAPACITY;
+    while ((table->count + 1)*16 > capacity*7) capacity *= 2;
+
+    int8_t *ctrl = table->ctrl;
+    TableEntry *entries = table->entries;
+    size_t old_capacity = table->capacity;
+    bool borrowed = table->borrowed;
+
+    table_alloc(table, capacity);
+    table->deleted = 0;
+    for (size_t k = 0; k < old_capacity; ++k) {
+        if (ctrl[k] < 0) continue;
+
+        size_t slot = table_find_free(table, table_hash(entries[k].key));
+        table_set_ctrl(table, slot, ctrl[k]);
+        table->entries[slot] = entries[k];
+    }
+
+    if (!borrowed) {
+        mem_free(ctrl);
+        mem_free(entries);
+    }
+}
+
+Value *value_create_table(void)
+{
+    Value *value = value_alloc(VT_TABLE);
+    value->table = mem_calloc(MEM_VALUES, 1, sizeof(Table));
+    table_alloc(value->table, TABLE_MINIMUM_CAPACITY);
+    return value;
+}
+
+void table_insert(Table *table, Value *key, Value *value)
+{
+    // takes over the references to key and value
+    uint64_t hash = table_hash(key);
+    Value *old_key = NULL, *old_value = NULL;
+
+    table_lock(table);
+    long found = table_find(table, key, hash);
+    if (found != -1) {
+        old_key = key;
+        old_value = table->entries[found].value;
+        table->entries[found].value = value;
+    } else {
+        if ((table->count + table->deleted + 1)*8 > table->capacity*7) table_resize(table);
+
+        size_t slot = table_find_free(table, hash);
+        if (table->ctrl[slot] == CTRL_DELETED) table->deleted--;
+        table_set_ctrl(table, slot, (int8_t) (hash & 0x7f));
+        table->entries[slot] = (TableEntry) {key, value};
+        table->count++;
+    }
+    table_unlock(table);
+
+    // released out of the lock, they may hold other tables
+    if (old_key != NULL) value_unref(old_key);
+    if (old_value != NULL) value_unref(old_value);
+}
+
+Value *table_get(Table *table, Value *key)
+{
+    // a reference to the value of key, NULL if missing
+    uint64_t hash = table_hash(key);
+
+    table_lock(table);
+    long found = table_find(table, key, hash);
+    Value *value = found != -1 ? value_ref(table->entries[found].value) : NULL;
+    table_unlock(table);
+    return value;
+}
+
+size_t table_count(Table *table)
+{
+    table_lock(table);
+    size_t count = table->count;
+    table_unlock(table);
+    return count;
+}
+
+bool table_contains(Table *table, Value *key)
+{
+    uint64_t hash = table_hash(key);
+
+    table_lock(table);
+    bool found = table_find(table, key, hash) != -1;
+    table_unlock(table);
+    return found;
+}
+
+void table_remove(Table *table, Value *key)
+{
+    uint64_t hash = table_hash(key);
+    TableEntry entry = {0};
+
+    table_lock(table);
+    long found = table_find(table, key, hash);
+    if (found != -1) {
+        entry = table->entries[found];
+        table->entries[found] = (TableEntry) {0};
+        table_set_ctrl(table, (size_t) found, CTRL_DELETED);
+        table->count--;
+        table->deleted++;
+    }
+    table_unlock(table);
+
+    if (entry.key != NULL) {
+        value_unref(entry.key);
+        value_unref(entry.value);
+    }
+}
+
+// tables this thread is printing, innermost first. A table may hold itself,
+// directly or through other tables, it's printed as [...] when met again
+typedef struct TablePrinting {
+    Table *table;
+    struct TablePrinting *outer;
+} TablePrinting;
+
+_Thread_local TablePrinting *table_printing = NULL;
+
+void table_print(Table *table)
+{
+    for (TablePrinting *p = table_printing; p != NULL; p = p->outer) {
+        if (p->table == table) {
+            fputs("[...]", rte_output());
+            return;
+        }
+    }
+
+    // in slot order, not insertion order. Entries are taken under the lock
+    // and printed out of it, nested tables take their own
+    table_lock(table);
+    size_t count = table->count;
+    TableEntry *entries = mem_alloc(MEM_VALUES, (count+1)*sizeof(*entries));
+    for (size_t k = 0, n = 0; k < table->capacity; ++k) {
+        if (table->ctrl[k] < 0) continue;
+        entries[n++] = (TableEntry) {value_ref(table->entries[k].key), value_ref(table->entries[k].value)};
+    }
+    table_unlock(table);
+
+    TablePrinting printing = {table, table_printing};
+    table_printing = &printing;
+
+    fputs("[", rte_output());
+    for (size_t n = 0; n < count; ++n) {
+        if (n > 0) fputs(", ", rte_output());
+        value_print(entries[n].key);
+        fputs(": ", rte_output());
+        value_print(entries[n].value);
+    }
+    fputs("]", rte_output());
+
+    table_printing = printing.outer;
+    for (size_t n = 0; n < count; ++n) {
+        value_unref(entries[n].key);
+        value_unref(entries[n].value);
+    }
+    mem_free(entries);
+}
+
+void table_release(Table *table)
+{
+    for (size_t k = 0; k < table->capacity; ++k) {
+        if (table->ctrl[k] < 0) continue;
+        value_unref(table->entries[k].key);
+        value_unref(table->entries[k].value);
+    }
+
+    if (!table->borrowed) {
+        mem_free(table->ctrl);
+        mem_free(table->entries);
+    }
+    mem_free(table);
+}
+
+void table_release_image(Value *value)
+{
+    // values of an image are never released, but its tables may have grown
+    // and taken values bound after loading. Each table is only emptied once,
+    // several values may point to it
+    if (!value->shared) {
+        value_unref(value);
+        return;
+    }
+
+    if (value->type == VT_ARRAY) {
+        for (size_t k = 0; k < value->array->count; ++k) table_release_image(value->array->items[k]);
+    }
+
+    if (value->type == VT_TABLE && value->table->capacity > 0) {
+        // marked first, its entries may lead back to it
+        Table *table = value->table;
+        size_t capacity = table->capacity;
+        table->capacity = 0;
+
+        for (size_t k = 0; k < capacity; ++k) {
+            if (table->ctrl[k] < 0) continue;
+            table_release_image(table->entries[k].key);
+            table_release_image(table->entries[k].value);
+        }
+
+        if (!table->borrowed) {
+            mem_free(table->ctrl);
+            mem_free(table->entries);
+        }
+    }
+}
+
+#endif  // TABLE_H_
@@ -0,0 +1,559 @@
+#ifndef TASKS_H_
+#define TASKS_H_
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "trap.h"
+#include "interpreter.h"
+#include "memstats.h"
+#include "stack.h"
+
+// Tasks: "n spawn name" moves the top n values to the data stack of a new
+// task that runs the routine name, "join" waits for it and pushes what the
+// routine left on that stack. Tasks run on a pool of workers, one per core,
+// each with a work-stealing deque (Chase-Lev): a worker pushes and pops the
+// tasks it spawns at the bottom of its own deque, idle workers steal the
+// oldest ones from the top of the others. Tasks spawned by threads that are
+// not workers (main, daemon workers) go through a shared queue. A thread
+// waiting on a join runs other tasks meanwhile, so nested joins never block
+// a worker.
+//
+// Every task has its own data stack and frames, values reach other threads
+// only as arguments and results. Once a program spawns, constants are shared
+// and refs are counted atomically (see values_atomic), globals are read and
+// bound under a lock. An error in a task ends the program, or fails the join
+// when the spawning thread has a trap set (library, daemon)
+//
+// "map name" and "reduce name" split an array in chunks and run a task per
+// chunk, calling the routine once per item on the stack of the task. Map
+// results are written at the position of their item and reduce combines the
+// result of each chunk in order, so the result never depends on scheduling
+
+#define TASK_DEQUE_CAPACITY 4096
+#define TASK_MAXIMUM_WORKERS 64
+
+// idle workers look for work this many times before going to sleep
+#define TASK_IDLE_SPINS 64
+
+// arrays are split in a few chunks per worker, to even out the load, but no
+// smaller than this many items so spawning stays cheap next to the work
+#define TASK_CHUNKS_PER_WORKER 4
+#define TASK_MINIMUM_CHUNK 32
+
+typedef enum {
+    TASK_CALL,
+    TASK_MAP,
+    TASK_REDUCE,
+} TaskKind;
+
+typedef struct Task {
+    TaskKind kind;
+    Routine *routine;
+    GScope *gscope;
+    Stack *mem;
+
+    // items [start, start+count) of array for map and reduce, map results
+    // go to the same positions of results
+    Array *array;
+    size_t start;
+    size_t count;
+    Array *results;
+
+    // output and trap of the spawning thread carry over to the task
+    FILE *out;
+    bool trapped;
+    bool failed;
+
+    int done;
+    int joined;
+} Task;
+
+typedef struct {
+    long top;
+    long bottom;
+    Task *tasks[TASK_DEQUE_CAPACITY];
+} TaskDeque;
+
+typedef struct {
+    TaskDeque *deques;
+    pthread_t *workers;
+    size_t worker_count;
+    size_t requested_workers;
+    bool started;
+
+    // set by scheduler_stop, workers leave once their task is done
+    bool stopping;
+
+    // tasks spawned by threads that are not workers, oldest at head
+    pthread_mutex_t lock;
+    Task **injected;
+    size_t injected_head;
+    size_t injected_count;
+    size_t injected_capacity;
+
+    // bumped on every spawn, idle workers sleep until it changes
+    unsigned long epoch;
+    size_t sleepers;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+} Scheduler;
+
+Scheduler scheduler = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .sleep_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+pthread_once_t scheduler_once = PTHREAD_ONCE_INIT;
+
+// index of the deque of the current thread, -1 when it is not a worker
+_Thread_local long task_worker = -1;
+
+bool deque_push(TaskDeque *deque, Task *task)
+{
+    // owner only, false when full
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_DEQUE_CAPACITY) return false;
+
+    __atomic_store_n(&deque->tasks[bottom % TASK_DEQUE_CAPACITY], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+Task *deque_pop(TaskDeque *deque)
+{
+    // owner only, newest task first
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    Task *task = __atomic_load_n(&deque->tasks[bottom % TASK_DEQUE_CAPACITY], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // last one, thieves may be after it as well
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&deque->bottom, bottom+1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+Task *deque_steal(TaskDeque *deque)
+{
+    // any thread, oldest task first, NULL when empty or lost to another thief
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if (top >= bottom) return NULL;
+
+    Task *task = __atomic_load_n(&deque->tasks[top % TASK_DEQUE_CAPACITY], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top+1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+void scheduler_inject(Task *task)
+{
+    pthread_mutex_lock(&scheduler.lock);
+    if (scheduler.injected_head == scheduler.injected_count) {
+        __atomic_store_n(&scheduler.injected_head, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&scheduler.injected_count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (scheduler.injected_count == scheduler.injected_capacity) {
+        scheduler.injected_capacity = scheduler.injected_capacity == 0 ? 64 : (scheduler.injected_capacity*2);
+        scheduler.injected = mem_realloc(MEM_STACK, scheduler.injected, scheduler.injected_capacity*sizeof(*scheduler.injected));
+    }
+
+    scheduler.injected[scheduler.injected_count] = task;
+    __atomic_store_n(&scheduler.injected_count, scheduler.injected_count+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&scheduler.lock);
+}
+
+Task *scheduler_take_injected(void)
+{
+    // checked without the lock first, every worker polls it when idle
+    if (__atomic_load_n(&scheduler.injected_count, __ATOMIC_ACQUIRE) == __atomic_load_n(&scheduler.injected_head, __ATOMIC_RELAXED))
+        return NULL;
+
+    Task *task = NULL;
+    pthread_mutex_lock(&scheduler.lock);
+    if (scheduler.injected_head < scheduler.injected_count) {
+        task = scheduler.injected[scheduler.injected_head];
+        __atomic_store_n(&scheduler.injected_head, scheduler.injected_head+1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&scheduler.lock);
+    return task;
+}
+
+void scheduler_wake(void)
+{
+    __atomic_add_fetch(&scheduler.epoch, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scheduler.sleepers, __ATOMIC_SEQ_CST) == 0) return;
+
+    pthread_mutex_lock(&scheduler.sleep_lock);
+    pthread_cond_signal(&scheduler.wake);
+    pthread_mutex_unlock(&scheduler.sleep_lock);
+}
+
+Task *scheduler_find(void)
+{
+    // own deque, then the shared queue, then steal starting from the next worker
+    long self = task_worker;
+    Task *task = NULL;
+
+    if (self != -1 && (task = deque_pop(&scheduler.deques[self])) != NULL) return task;
+    if ((task = scheduler_take_injected()) != NULL) return task;
+
+    size_t count = scheduler.worker_count;
+    for (size_t k = 1; k <= count; ++k) {
+        size_t victim = (size_t) (self + k) % count;
+        if ((long) victim == self) continue;
+        if ((task = deque_steal(&scheduler.deques[victim])) != NULL) return task;
+    }
+    return NULL;
+}
+
+Value *task_apply(Task *task, FrameStack *frames)
+{
+    // the routine takes what is on the stack of the task, one value is left
+    rte_execute(task->routine, task->mem, frames, task->gscope);
+    if (task->mem->count != 1) {
+        fprintf(stderr, ERR_PREFIX"Routine '%s' must leave one value for '%s', it left %zu\n",
+                ERR_EXP, task->routine->id, task->kind == TASK_MAP ? "map" : "reduce", task->mem->count);
+        exit(EXIT_FAILURE);
+    }
+    return task->mem->items[--task->mem->count];
+}
+
+void task_map_chunk(Task *task, FrameStack *frames)
+{
+    for (size_t i = task->start; i < task->start + task->count; ++i) {
+        st_push(task->mem, value_ref(task->array->items[i]));
+        task->results->items[i] = task_apply(task, frames);
+    }
+}
+
+void task_reduce_chunk(Task *task, FrameStack *frames)
+{
+    // left to right, the result is left on the stack of the task
+    Value *acc = value_ref(task->array->items[task->start]);
+    for (size_t i = task->start+1; i < task->start + task->count; ++i) {
+        st_push(task->mem, acc);
+        st_push(task->mem, value_ref(task->array->items[i]));
+        acc = task_apply(task, frames);
+    }
+    st_push(task->mem, acc);
+}
+
+void task_run(Task *task)
+{
+    // each task gets frames of its own, a task run by a thread waiting on a
+    // join sits on top of the one that is waiting
+    FILE *out = rte_out;
+    jmp_buf *outer = rte_trap;
+    jmp_buf trap;
+    FrameStack *frames = frames_create(DEFAULT_STACK_INITIAL_CAPACITY);
+
+    rte_out = task->out;
+    rte_trap = task->trapped ? &trap : NULL;
+
+    if (setjmp(trap) == 0) {
+        switch (task->kind) {
+            case TASK_CALL: rte_execute(task->routine, task->mem, frames, task->gscope);
+                break;
+            case TASK_MAP: task_map_chunk(task, frames);
+                break;
+            case TASK_REDUCE: task_reduce_chunk(task, frames);
+                break;
+        }
+    } else {
+        // frames of the calls that were running are released
+        frames_leave(frames, 0);
+        task->failed = true;
+    }
+
+    frames_destroy(frames);
+    rte_trap = outer;
+    rte_out = out;
+
+    // workers run until the program ends, their counters are merged before
+    // anybody can see the results
+    if (task_worker != -1) mem_stats_flush();
+    __atomic_store_n(&task->done, true, __ATOMIC_RELEASE);
+}
+
+void *task_worker_loop(void *arg)
+{
+    task_worker = (long) (size_t) arg;
+
+    while (!__atomic_load_n(&scheduler.stopping, __ATOMIC_SEQ_CST)) {
+        unsigned long epoch = __atomic_load_n(&scheduler.epoch, __ATOMIC_SEQ_CST);
+        Task *task = NULL;
+
+        for (size_t spin = 0; spin < TASK_IDLE_SPINS && task == NULL; ++spin) {
+            task = scheduler_find();
+            if (task == NULL) sched_yield();
+        }
+
+        if (task != NULL) {
+            task_run(task);
+            continue;
+        }
+
+        // nothing spawned since the search started, sleep until something is
+        pthread_mutex_lock(&scheduler.sleep_lock);
+        __atomic_add_fetch(&scheduler.sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&scheduler.epoch, __ATOMIC_SEQ_CST) == epoch && !scheduler.stopping)
+            pthread_cond_wait(&scheduler.wake, &scheduler.sleep_lock);
+        __atomic_sub_fetch(&scheduler.sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&scheduler.sleep_lock);
+    }
+
+    return NULL;
+}
+
+void scheduler_start(void)
+{
+    size_t count = __atomic_load_n(&scheduler.requested_workers, __ATOMIC_RELAXED);
+    if (count == 0) count = (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (count == 0) count = 1;
+    if (count > TASK_MAXIMUM_WORKERS) count = TASK_MAXIMUM_WORKERS;
+
+    scheduler.deques = mem_calloc(MEM_STACK, count, sizeof(*scheduler.deques));
+    scheduler.workers = mem_calloc(MEM_STACK, count, sizeof(*scheduler.workers));
+    scheduler.worker_count = count;
+
+    for (size_t k = 0; k < count; ++k) {
+        if (pthread_create(&scheduler.workers[k], NULL, task_worker_loop, (void *) k) != 0) {
+            fprintf(stderr, ERR_PREFIX"Could not start task worker\n", ERR_EXP);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    __atomic_store_n(&scheduler.started, true, __ATOMIC_RELEASE);
+}
+
+void scheduler_stop(void)
+{
+    // at the end of the program, workers are woken and joined, then the
+    // scheduler memory is released. Tasks never joined stay behind
+    if (!__atomic_load_n(&scheduler.started, __ATOMIC_ACQUIRE)) return;
+
+    pthread_mutex_lock(&scheduler.sleep_lock);
+    __atomic_store_n(&scheduler.stopping, true, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&scheduler.epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&scheduler.wake);
+    pthread_mutex_unlock(&scheduler.sleep_lock);
+
+    for (size_t k = 0; k < scheduler.worker_count; ++k) pthread_join(scheduler.workers[k], NULL);
+    __atomic_store_n(&scheduler.started, false, __ATOMIC_RELEASE);
+
+    mem_free(scheduler.deques);
+    mem_free(scheduler.workers);
+    mem_free(scheduler.injected);
+    scheduler.deques = NULL;
+    scheduler.workers = NULL;
+    scheduler.injected = NULL;
+    scheduler.injected_head = scheduler.injected_count = scheduler.injected_capacity = 0;
+}
+
+bool gscope_uses_tasks(GScope *gscope)
+{
+    Module *mod = gscope->mod;
+
+    for (size_t j = 0; j < gscope->rte_count; ++j) {
+        Routine *routine = gscope->routines[j];
+        for (size_t i = routine->src_start; i < routine->src_start + routine->src_count; ++i) {
+            TokenType ttype = mod->types[i];
+            if (ttype == KW_SPAWN || ttype == KW_MAP || ttype == KW_REDUCE) return true;
+        }
+    }
+    return false;
+}
+
+void tasks_prepare(GScope *gscope, size_t workers)
+{
+    // a program that spawns, maps or reduces is compiled as a whole before
+    // running, nothing is modified once tasks run, then its constants are
+    // shared and the workers started. workers is 0 for one per core, the
+    // first program to use tasks decides
+    if (!gscope_uses_tasks(gscope)) return;
+
+    gscope_compile_routines(gscope);
+    for (size_t i = 0; i < gscope->const_count; ++i)
+        gscope->constants[i]->shared = true;
+
+    __atomic_store_n(&values_atomic, true, __ATOMIC_RELAXED);
+
+    size_t none = 0;
+    __atomic_compare_exchange_n(&scheduler.requested_workers, &none, workers, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    pthread_once(&scheduler_once, scheduler_start);
+}
+
+Task *task_create(GScope *gscope, Routine *routine, TaskKind kind, size_t capacity)
+{
+    Task *task = mem_alloc(MEM_STACK, sizeof(Task));
+    task->kind = kind;
+    task->routine = routine;
+    task->gscope = gscope;
+    task->mem = st_create_on_heap(capacity > DEFAULT_STACK_INITIAL_CAPACITY ? capacity : DEFAULT_STACK_INITIAL_CAPACITY);
+    task->array = NULL;
+    task->start = 0;
+    task->count = 0;
+    task->results = NULL;
+    task->out = rte_out;
+    task->trapped = rte_trap != NULL;
+    task->failed = false;
+    task->done = false;
+    task->joined = false;
+    return task;
+}
+
+void task_schedule(Task *task)
+{
+    // the tracer records a single thread, programs that were not prepared
+    // and full deques run the task right away
+    bool queued = false;
+    if (!tracer.enabled && __atomic_load_n(&scheduler.started, __ATOMIC_ACQUIRE)) {
+        if (task_worker != -1) queued = deque_push(&scheduler.deques[task_worker], task);
+        else {
+            scheduler_inject(task);
+            queued = true;
+        }
+    }
+
+    if (queued) scheduler_wake();
+    else task_run(task);
+}
+
+Task *task_spawn(GScope *gscope, Routine *routine, Stack *mem, size_t n)
+{
+    Task *task = task_create(gscope, routine, TASK_CALL, n);
+
+    mem->count -= n;
+    memcpy(task->mem->items, mem->items + mem->count, n*sizeof(*mem->items));
+    task->mem->count = n;
+
+    task_schedule(task);
+    return task;
+}
+
+void task_wait(Task *task)
+{
+    // run other tasks until this one is done
+    while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+        Task *other = __atomic_load_n(&scheduler.started, __ATOMIC_ACQUIRE) ? scheduler_find() : NULL;
+        if (other != NULL) task_run(other);
+        else sched_yield();
+    }
+}
+
+void task_check(Task *task)
+{
+    if (task->failed) {
+        fprintf(stderr, ERR_PREFIX"Task of routine '%s' failed\n", ERR_EXP, task->routine->id);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void task_join(Task *task, Stack *mem)
+{
+    if (__atomic_exchange_n(&task->joined, true, __ATOMIC_ACQ_REL)) {
+        fprintf(stderr, ERR_PREFIX"Task of routine '%s' has already been joined\n", ERR_EXP, task->routine->id);
+        exit(EXIT_FAILURE);
+    }
+
+    task_wait(task);
+    task_check(task);
+
+    // results move to the joining stack
+    for (size_t i = 0; i < task->mem->count; ++i)
+        st_push(mem, task->mem->items[i]);
+    task->mem->count = 0;
+}
+
+void task_release(Task *task)
+{
+    // the last handle is gone, a task that was never joined is waited for
+    task_wait(task);
+    st_destroy_from_heap(task->mem);
+    mem_free(task);
+}
+
+size_t array_chunk_tasks(GScope *gscope, Routine *routine, TaskKind kind, Array *array, Array *results, Task **tasks)
+{
+    // one task per chunk of array, a single chunk runs on the calling thread.
+    // Every task is done when this returns
+    size_t parts = TASK_CHUNKS_PER_WORKER;
+    if (__atomic_load_n(&scheduler.started, __ATOMIC_ACQUIRE)) parts *= scheduler.worker_count;
+
+    size_t chunk = (array->count + parts-1) / parts;
+    if (chunk < TASK_MINIMUM_CHUNK) chunk = TASK_MINIMUM_CHUNK;
+
+    size_t task_count = 0;
+    for (size_t start = 0; start < array->count; start += chunk) {
+        Task *task = task_create(gscope, routine, kind, 2);
+        task->array = array;
+        task->start = start;
+        task->count = array->count - start < chunk ? array->count - start : chunk;
+        task->results = results;
+        tasks[task_count++] = task;
+    }
+
+    if (task_count == 1) task_run(tasks[0]);
+    else for (size_t t = 0; t < task_count; ++t) task_schedule(tasks[t]);
+
+    // all of them are waited for before failing, none may still use array
+    for (size_t t = 0; t < task_count; ++t) task_wait(tasks[t]);
+    for (size_t t = 0; t < task_count; ++t) task_check(tasks[t]);
+    return task_count;
+}
+
+Value *array_map(GScope *gscope, Routine *routine, Value *array)
+{
+    Task **tasks = mem_alloc(MEM_STACK, (array->array->count/TASK_MINIMUM_CHUNK + 1)*sizeof(*tasks));
+    Value *results = value_create_array(array->array->count);
+
+    size_t task_count = array_chunk_tasks(gscope, routine, TASK_MAP, array->array, results->array, tasks);
+    for (size_t t = 0; t < task_count; ++t) task_release(tasks[t]);
+
+    mem_free(tasks);
+    return results;
+}
+
+Value *array_reduce(GScope *gscope, Routine *routine, Value *array)
+{
+    // the result of each chunk is left on its stack, they are reduced again
+    // until a single chunk remains
+    Task **tasks = mem_alloc(MEM_STACK, (array->array->count/TASK_MINIMUM_CHUNK + 1)*sizeof(*tasks));
+    size_t task_count = array_chunk_tasks(gscope, routine, TASK_REDUCE, array->array, NULL, tasks);
+
+    Value *partials = value_create_array(task_count);
+    for (size_t t = 0; t < task_count; ++t) {
+        partials->array->items[t] = tasks[t]->mem->items[0];
+        tasks[t]->mem->count = 0;
+        task_release(tasks[t]);
+    }
+    mem_free(tasks);
+
+    if (task_count == 1) {
+        Value *result = value_ref(partials->array->items[0]);
+        value_unref(partials);
+        return result;
+    }
+
+    Value *result = array_reduce(gscope, routine, partials);
+    value_unref(partials);
+    return result;
+}
+
+#endif // TASKS_H_
@@ -0,0 +1,96 @@
+#ifndef TEXT_H_
+#define TEXT_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "scan.h"
+#include "stack.h"
+
+// String words: concat, slice and find, concat also takes numbers and bools.
+// Strings share their StrBuf, a slice points into the buffer of the string it
+// comes from and concat writes right after its first operand when that one
+// ends where the buffer is filled, so "s s x concat s =" in a loop appends in
+// place and the buffer doubles when full. A slice keeps the whole buffer
+// alive. Views and shared strings are never written to or referenced, they
+// are copied instead
+
+#define STRBUF_MINIMUM_CAPACITY 64
+
+bool strbuf_claim(StrBuf *buf, size_t end, size_t count)
+{
+    // only one string may grow past the filled end of a buffer
+    if (VALUES_ATOMIC())
+        return __atomic_compare_exchange_n(&buf->fill, &end, end + count, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    if (buf->fill != end) return false;
+    buf->fill += count;
+    return true;
+}
+
+const char *string_bytes(Value *value, char *buf, size_t *len)
+{
+    // numbers and bools are formatted into buf, like "." prints them
+    if (value->type == VT_STRING) {
+        *len = value->len;
+        return value->txt;
+    }
+
+    *len = value_format(buf, value);
+    return buf;
+}
+
+Value *string_concat(Value *a, Value *b)
+{
+    char a_buf[FMT_NUMBER_MAX_SIZE], b_buf[FMT_NUMBER_MAX_SIZE];
+    size_t a_len, b_len;
+    const char *a_txt = string_bytes(a, a_buf, &a_len);
+    const char *b_txt = string_bytes(b, b_buf, &b_len);
+
+    size_t len = a_len + b_len;
+    string_check_len(len);
+
+    if (a->type == VT_STRING && !a->view && !a->shared) {
+        StrBuf *buf = strbuf_of(a);
+        size_t end = (size_t) a->start + a_len;
+        if (end + b_len < buf->capacity && strbuf_claim(buf, end, b_len)) {
+            memcpy(buf->data + end, b_txt, b_len);
+            buf->data[end + b_len] = '\0';
+            strbuf_ref(buf);
+            return value_create_strbuf(buf, a->start, len);
+        }
+    }
+
+    // a new buffer with as much room as the result, for the next appends
+    size_t capacity = len < STRBUF_MINIMUM_CAPACITY/2 ? STRBUF_MINIMUM_CAPACITY : (len*2);
+    StrBuf *buf = strbuf_create(len, capacity);
+    memcpy(buf->data, a_txt, a_len);
+    memcpy(buf->data + a_len, b_txt, b_len);
+    return value_create_strbuf(buf, 0, len);
+}
+
+Value *string_slice(Value *value, size_t start, size_t len)
+{
+    assert(start + len <= value->len);
+    if (value->view || value->shared) return value_create_string_len(value->txt + start, len);
+
+    strbuf_ref(strbuf_of(value));
+    return value_create_strbuf(strbuf_of(value), value->start + start, len);
+}
+
+long string_find(Value *value, Value *needle)
+{
+    // offset of the first occurrence of needle, -1 if missing
+    if (needle->len == 0) return 0;
+    if (needle->len > value->len) return -1;
+
+    // candidates start with the first byte of needle
+    size_t size = value->len - needle->len + 1;
+    for (size_t c = scan_find_byte(value->txt, 0, size, needle->txt[0]); c < size;
+         c = scan_find_byte(value->txt, c+1, size, needle->txt[0])) {
+        if (memcmp(value->txt + c, needle->txt, needle->len) == 0) return (long) c;
+    }
+    return -1;
+}
+
+#endif  // TEXT_H_
@@ -0,0 +1,255 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "format.h"
+#include "lexer.h"
+#include "stack.h"
+
+// Execution tracer: rte_execute records every token it runs into a fixed
+// size ring buffer, which is dumped when the program fails or on SIGUSR1.
+// Entries point to the source token, shown as row:col, the trace file
+// carries the locations so a replay shows them too. When disabled the cost
+// is a single predictable branch per token
+
+#define TRACE_DEFAULT_CAPACITY 4096
+#define TRACE_FILE_MAGIC "PCTRACE2"
+
+typedef struct {
+    uint32_t routine;
+
+    // module token the instruction comes from
+    uint32_t src;
+    uint32_t depth;
+    uint16_t ttype;
+    uint8_t top_type;
+    uint8_t reserved;
+} TraceEntry;
+
+typedef struct {
+    bool enabled;
+    TraceEntry *ring;
+    size_t mask;
+    _Atomic uint64_t head;
+
+    // names of the traced routines, indexed by TraceEntry.routine, and
+    // locations of the module tokens, indexed by TraceEntry.src
+    char **routine_ids;
+    size_t rte_count;
+    TokenLoc *locs;
+    size_t loc_count;
+
+    FILE *file;
+    bool clean_exit;
+    int dump_fd;
+} Tracer;
+
+Tracer tracer = {0};
+
+void trace_record(size_t routine, size_t src, TokenType ttype, Stack *mem)
+{
+    TraceEntry entry = {
+        .routine = (uint32_t) routine,
+        .src = (uint32_t) src,
+        .depth = (uint32_t) mem->count,
+        .ttype = (uint16_t) ttype,
+        .top_type = mem->count > 0 ? (uint8_t) st_peek(mem, 0)->type : VT_UNKNOWN,
+    };
+
+    // slots are claimed atomically so concurrent writers never collide
+    uint64_t slot = atomic_fetch_add_explicit(&tracer.head, 1, memory_order_relaxed);
+    tracer.ring[slot & tracer.mask] = entry;
+
+    if (tracer.file != NULL) fwrite(&entry, sizeof(entry), 1, tracer.file);
+}
+
+void trace_write(const char *txt, size_t len)
+{
+    // dumping may happen inside a signal handler, stick to write(2)
+    while (len > 0) {
+        ssize_t written = write(tracer.dump_fd, txt, len);
+        if (written <= 0) return;
+        txt += written;
+        len -= written;
+    }
+}
+
+void trace_write_str(const char *txt)
+{
+    trace_write(txt, strlen(txt));
+}
+
+void trace_write_uint(uint64_t n)
+{
+    char buf[FMT_NUMBER_MAX_SIZE];
+    trace_write(buf, fmt_uint(buf, n));
+}
+
+void trace_write_entry(TraceEntry *entry, char **routine_ids, size_t rte_count, TokenLoc *locs, size_t loc_count)
+{
+    trace_write_str("    ");
+    if (entry->routine < rte_count) trace_write_str(routine_ids[entry->routine]);
+    else trace_write_str("?");
+    trace_write_str(":");
+    if (entry->src < loc_count) {
+        trace_write_uint(locs[entry->src].row);
+        trace_write_str(":");
+        trace_write_uint(locs[entry->src].col);
+    } else trace_write_str("?");
+    trace_write_str(" ");
+    trace_write_str(entry->ttype < _IOTA ? ttype_tostr(entry->ttype) : "?");
+    trace_write_str(" depth=");
+    trace_write_uint(entry->depth);
+    trace_write_str(" top=");
+    trace_write_str(entry->top_type > VT_UNKNOWN && entry->top_type < VT_IOTA ? vtype_tostr(entry->top_type) : "-");
+    trace_write_str("\n");
+}
+
+void trace_dump(void)
+{
+    uint64_t head = atomic_load_explicit(&tracer.head, memory_order_relaxed);
+    uint64_t capacity = tracer.mask + 1;
+    uint64_t first = head > capacity ? head - capacity : 0;
+
+    trace_write_str(">>>>>>> [TRACE] last ");
+    trace_write_uint(head - first);
+    trace_write_str(" of ");
+    trace_write_uint(head);
+    trace_write_str(" executed tokens\n");
+
+    for (uint64_t k = first; k < head; ++k)
+        trace_write_entry(&tracer.ring[k & tracer.mask], tracer.routine_ids, tracer.rte_count, tracer.locs, tracer.loc_count);
+}
+
+void trace_signal_handler(int signum)
+{
+    trace_dump();
+
+    // fatal signals continue with their default behaviour
+    if (signum != SIGUSR1) {
+        signal(signum, SIG_DFL);
+        raise(signum);
+    }
+}
+
+void trace_at_exit(void)
+{
+    // every exit before the end of main is an error exit
+    if (!tracer.clean_exit) trace_dump();
+    if (tracer.file != NULL) fclose(tracer.file);
+}
+
+void trace_enable(size_t capacity)
+{
+    // round capacity up to a power of two so slots are found with a mask
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+
+    tracer.ring = calloc(size, sizeof(*tracer.ring));
+    if (tracer.ring == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not allocate memory\n", ERR_EXP);
+        exit(EXIT_FAILURE);
+    }
+    tracer.mask = size - 1;
+    tracer.dump_fd = STDERR_FILENO;
+    tracer.enabled = true;
+
+    atexit(trace_at_exit);
+    signal(SIGUSR1, trace_signal_handler);
+    signal(SIGABRT, trace_signal_handler);
+    signal(SIGSEGV, trace_signal_handler);
+}
+
+void trace_open_file(const char *file_path)
+{
+    tracer.file = fopen(file_path, "wb");
+    if (tracer.file == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not open file: %s\n", ERR_EXP, file_path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void trace_set_routines(char **routine_ids, size_t rte_count, Module *mod)
+{
+    tracer.routine_ids = routine_ids;
+    tracer.rte_count = rte_count;
+    tracer.locs = mod != NULL ? mod->locs : NULL;
+    tracer.loc_count = mod != NULL ? mod->count : 0;
+
+    if (tracer.file == NULL || mod == NULL) return;
+
+    // header: magic, routine count and length prefixed routine names, token
+    // count and token locations, followed by raw TraceEntry records until
+    // end of file
+    uint32_t count = (uint32_t) rte_count;
+    fwrite(TRACE_FILE_MAGIC, 1, strlen(TRACE_FILE_MAGIC), tracer.file);
+    fwrite(&count, sizeof(count), 1, tracer.file);
+    for (size_t j = 0; j < rte_count; ++j) {
+        uint32_t len = (uint32_t) strlen(routine_ids[j]);
+        fwrite(&len, sizeof(len), 1, tracer.file);
+        fwrite(routine_ids[j], 1, len, tracer.file);
+    }
+
+    uint32_t loc_count = (uint32_t) mod->count;
+    fwrite(&loc_count, sizeof(loc_count), 1, tracer.file);
+    fwrite(mod->locs, sizeof(*mod->locs), mod->count, tracer.file);
+}
+
+void trace_replay(const char *file_path)
+{
+    FILE *file = fopen(file_path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, ERR_PREFIX"Could not open file: %s\n", ERR_EXP, file_path);
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[sizeof(TRACE_FILE_MAGIC)] = {0};
+    uint32_t rte_count = 0;
+    if (fread(magic, 1, strlen(TRACE_FILE_MAGIC), file) != strlen(TRACE_FILE_MAGIC) ||
+        strcmp(magic, TRACE_FILE_MAGIC) != 0 || fread(&rte_count, sizeof(rte_count), 1, file) != 1) {
+        fprintf(stderr, ERR_PREFIX"Not a trace file: %s\n", ERR_EXP, file_path);
+        exit(EXIT_FAILURE);
+    }
+
+    char **routine_ids = calloc(rte_count, sizeof(*routine_ids));
+    for (uint32_t j = 0; j < rte_count; ++j) {
+        uint32_t len = 0;
+        if (fread(&len, sizeof(len), 1, file) != 1) {
+            fprintf(stderr, ERR_PREFIX"Truncated trace file: %s\n", ERR_EXP, file_path);
+            exit(EXIT_FAILURE);
+        }
+        routine_ids[j] = calloc(len+1, 1);
+        if (fread(routine_ids[j], 1, len, file) != len) {
+            fprintf(stderr, ERR_PREFIX"Truncated trace file: %s\n", ERR_EXP, file_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t loc_count = 0;
+    TokenLoc *locs = NULL;
+    if (fread(&loc_count, sizeof(loc_count), 1, file) != 1 ||
+        (locs = calloc(loc_count + 1, sizeof(*locs))) == NULL ||
+        fread(locs, sizeof(*locs), loc_count, file) != loc_count) {
+        fprintf(stderr, ERR_PREFIX"Truncated trace file: %s\n", ERR_EXP, file_path);
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    tracer.dump_fd = STDOUT_FILENO;
+    TraceEntry entry;
+    while (fread(&entry, sizeof(entry), 1, file) == 1)
+        trace_write_entry(&entry, routine_ids, rte_count, locs, loc_count);
+
+    for (uint32_t j = 0; j < rte_count; ++j) free(routine_ids[j]);
+    free(routine_ids);
+    free(locs);
+    fclose(file);
+}
+
+#endif  // TRACE_H_
@@ -0,0 +1,21 @@
+#ifndef TRAP_H_
+#define TRAP_H_
+#include <setjmp.h>
+#include <stdlib.h>
+
+// the interpreter exits on errors, code that has to outlive them (the
+// embedding api, daemon workers) sets a trap on its thread and an error
+// jumps back to it instead. Values that were being worked on when the error
+// happened are leaked
+_Thread_local jmp_buf *rte_trap = NULL;
+
+void rte_fail(int status)
+{
+    if (rte_trap != NULL) longjmp(*rte_trap, 1);
+    exit(status);
+}
+
+// every header included after this one goes through rte_fail
+#define exit(status) rte_fail(status)
+
+#endif  // TRAP_H_
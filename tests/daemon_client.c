@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// sends one request line to a pancake daemon and prints the reply
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s SOCKET REQUEST\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Could not connect to %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    size_t len = strlen(argv[2]);
+    if (write(fd, argv[2], len) != (ssize_t) len || write(fd, "\n", 1) != 1) return EXIT_FAILURE;
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) fwrite(buf, 1, (size_t) n, stdout);
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pancake.h"
+
+// an error inside each-line releases the reader: stdin can be read again
+// and files are closed. Usage: input_host FILE < lines
+
+size_t open_fds(void)
+{
+    size_t count = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) return 0;
+    while (readdir(dir) != NULL) count++;
+    closedir(dir);
+    return count;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) return EXIT_FAILURE;
+
+    char source[4096];
+    snprintf(source, sizeof(source),
+             ":fail(line) 1 0 / end\n"
+             ":file \"%s\" each-line fail end\n"
+             ":stdin \"-\" each-line fail end\n"
+             ":next read-line drop end\n", argv[1]);
+
+    PancakeProgram *program = pancake_compile(source, "input");
+    if (program == NULL) return EXIT_FAILURE;
+
+    PancakeStack *stack = pancake_stack_create();
+    int fail = 0;
+
+    size_t fds = open_fds();
+    for (int i = 0; i < 100; ++i) {
+        if (pancake_call(program, "file", stack) != PANCAKE_ERROR) fail = 1;
+        pancake_stack_clear(stack);
+    }
+    if (open_fds() != fds) {
+        printf("each-line on a file leaks descriptors: %zu then %zu\n", fds, open_fds());
+        fail = 1;
+    }
+
+    if (pancake_call(program, "stdin", stack) != PANCAKE_ERROR) fail = 1;
+    pancake_stack_clear(stack);
+    if (pancake_call(program, "next", stack) != PANCAKE_OK) {
+        puts("read-line after a failed each-line on stdin did not answer");
+        fail = 1;
+    } else if (pancake_type(stack, 0) != PANCAKE_STRING) {
+        puts("read-line after a failed each-line on stdin did not read a line");
+        fail = 1;
+    }
+
+    pancake_stack_free(stack);
+    pancake_program_free(program);
+    return fail;
+}
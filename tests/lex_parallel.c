@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#define ERR_PREFIX "ERROR %s:%d: "
+#define ERR_EXP __FILE__, __LINE__
+
+#include "trap.h"
+#include "lexer.h"
+
+// lexing on several threads gives the same tokens as lexing on one, also
+// when a chunk starts right after ':' or '@'
+
+char *repeat(const char *line, size_t size)
+{
+    size_t len = strlen(line);
+    size_t count = size/len + 1;
+    char *buffer = malloc(count*len + 1);
+    for (size_t k = 0; k < count; ++k) memcpy(buffer + k*len, line, len);
+    buffer[count*len] = '\0';
+    return buffer;
+}
+
+bool same_tokens(const char *line)
+{
+    char *buffer = repeat(line, 2*LEX_PARALLEL_MINIMUM_SIZE);
+    Module *serial = lex_buffer(buffer, "serial");
+    Module *parallel = lex_buffer_parallel(buffer, "parallel", 8);
+
+    bool same = serial->count == parallel->count;
+    for (size_t i = 0; same && i < serial->count; ++i) {
+        same = serial->types[i] == parallel->types[i] &&
+               serial->locs[i].row == parallel->locs[i].row && serial->locs[i].col == parallel->locs[i].col &&
+               strcmp(mod_txt(serial, i), mod_txt(parallel, i)) == 0;
+        if (!same) {
+            printf("token %zu differs: %s '%s' serially, %s '%s' in parallel\n", i,
+                   ttype_tostr(mod_type(serial, i)), mod_txt(serial, i),
+                   ttype_tostr(mod_type(parallel, i)), mod_txt(parallel, i));
+        }
+    }
+    if (serial->count != parallel->count)
+        printf("%zu tokens serially, %zu in parallel\n", serial->count, parallel->count);
+
+    mod_destroy(serial);
+    mod_destroy(parallel);
+    free(buffer);
+    return same;
+}
+
+int main(void)
+{
+    // every line ends with the symbol, the next chunk starts after it
+    const char *lines[] = {
+        "\"abc\" 1 :\n",
+        "\"abc\" 1 @\n",
+        "abc \"x\" :\n",
+        "len 1 @\n",
+        "true 2 :\n",
+    };
+
+    int fail = 0;
+    for (size_t k = 0; k < sizeof(lines)/sizeof(*lines); ++k) {
+        if (!same_tokens(lines[k])) fail = 1;
+    }
+    return fail;
+}
@@ -0,0 +1,35 @@
+# sourced by the tests. Programs run with inlining on and off, their stdout
+# is compared without the debug dump, errors without the source position
+# of the interpreter that reports them
+
+strip_dump() {
+    sed '1,/^>>>>>>> \[ROUTINES\]/d' | sed '1,/^=========/d'
+}
+
+# expect_output NAME EXPECTED [OPTION...] FILE
+expect_output() {
+    name=$1
+    expected=$2
+    shift 2
+    for inline in --inline-threshold=8 --no-inline; do
+        out=$(bin/pancake "$inline" "$@" 2>/dev/null | strip_dump)
+        if [ "$out" != "$expected" ]; then
+            printf '%s (%s): expected\n%s\ngot\n%s\n' "$name" "$inline" "$expected" "$out"
+            return 1
+        fi
+    done
+}
+
+# expect_error NAME EXPECTED [OPTION...] FILE, the program must fail
+expect_error() {
+    name=$1
+    expected=$2
+    shift 2
+    for inline in --inline-threshold=8 --no-inline; do
+        out=$(bin/pancake "$inline" "$@" 2>&1 >/dev/null | sed 's/^ERROR [^ ]* //')
+        if [ "$out" != "$expected" ]; then
+            printf '%s (%s): expected error\n%s\ngot\n%s\n' "$name" "$inline" "$expected" "$out"
+            return 1
+        fi
+    done
+}
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pancake.h"
+
+// bad sources and runtime errors come back as NULL and PANCAKE_ERROR, the
+// host keeps going and the program still answers afterwards
+
+int main(void)
+{
+    const char *broken[] = {
+        ":main 1 $ end",
+        "1 :main end",
+        "@main 1 :main end",
+        "@x abc :main end",
+        "@x",
+        ":main 1 .",
+        ":main nope end",
+    };
+
+    int fail = 0;
+    for (size_t i = 0; i < sizeof(broken)/sizeof(*broken); ++i) {
+        PancakeProgram *program = pancake_compile(broken[i], "broken");
+        if (program != NULL) {
+            printf("compiled a broken source: %s\n", broken[i]);
+            pancake_program_free(program);
+            fail = 1;
+        }
+    }
+
+    PancakeProgram *program = pancake_compile(":divide(a, b) a b / end\n:modulo(a, b) a b % end\n", "ok");
+    if (program == NULL) {
+        puts("could not compile a valid source");
+        return EXIT_FAILURE;
+    }
+
+    PancakeStack *stack = pancake_stack_create();
+    pancake_push_int(stack, 1);
+    pancake_push_int(stack, 0);
+    if (pancake_call(program, "divide", stack) != PANCAKE_ERROR) {
+        puts("division by zero did not fail");
+        fail = 1;
+    }
+
+    pancake_stack_clear(stack);
+    pancake_push_int(stack, 7);
+    pancake_push_int(stack, 0);
+    if (pancake_call(program, "modulo", stack) != PANCAKE_ERROR) {
+        puts("modulo by zero did not fail");
+        fail = 1;
+    }
+
+    pancake_stack_clear(stack);
+    pancake_push_int(stack, 7);
+    pancake_push_int(stack, 2);
+    if (pancake_call(program, "modulo", stack) != PANCAKE_OK || pancake_get_int(stack, 0) != 1) {
+        puts("modulo after an error did not answer 1");
+        fail = 1;
+    }
+
+    pancake_stack_free(stack);
+    pancake_program_free(program);
+    return fail;
+}
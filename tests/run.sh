@@ -0,0 +1,21 @@
+#!/bin/sh
+# runs every tests/test_*.sh against bin/pancake, a test is a shell script
+# exiting non-zero on failure. Helpers are built in bin/tests
+cd "$(dirname "$0")/.." || exit 1
+
+mkdir -p bin/tests
+gcc -Wall -Wextra tests/daemon_client.c -o bin/tests/daemon_client || exit 1
+gcc -Wall -Wextra -Isrc tests/library_host.c bin/libpancake.a -o bin/tests/library_host -lm -lpthread || exit 1
+gcc -Wall -Wextra -Isrc tests/lex_parallel.c -o bin/tests/lex_parallel -lm -lpthread || exit 1
+gcc -Wall -Wextra -Isrc tests/input_host.c bin/libpancake.a -o bin/tests/input_host -lm -lpthread || exit 1
+
+fail=0
+for test in tests/test_*.sh; do
+    if sh "$test"; then
+        echo "ok   $test"
+    else
+        echo "FAIL $test"
+        fail=1
+    fi
+done
+exit $fail
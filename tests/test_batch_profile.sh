@@ -0,0 +1,17 @@
+#!/bin/sh
+# a batch the tracer keeps out of lock step is entered once in the profile
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf ':fib(n) n 2 < if n else n 1 - fib n 2 - fib + then end\n:work(n) n fib end\n:main end\n' > "$dir/batch.pc"
+seq 1 300 | sed 's/.*/18/' > "$dir/batch.in"
+
+bin/pancake --batch=work --trace=16 --profile="$dir/batch.prof" "$dir/batch.pc" < "$dir/batch.in" >/dev/null 2>&1 || exit 1
+if ! grep -q '^work' "$dir/batch.prof"; then
+    echo "profile: no samples of work"
+    exit 1
+fi
+if grep -q '^work;work' "$dir/batch.prof"; then
+    echo "profile: work entered twice"
+    exit 1
+fi
@@ -0,0 +1,49 @@
+#!/bin/sh
+# if/else/then jump to the right place, nested and in called routines, and
+# unbalanced branches are reported with their position
+. tests/lib.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/branching.pc" <<'PC'
+:sign
+    dup 0 < if drop "negative" else
+        0 == if "zero" else "positive" then
+    then
+end
+
+:grade(n)
+    n 90 >= if "A" else
+        n 75 >= if "B" else
+            n 50 >= if "C" else "F" then
+        then
+    then
+end
+
+:countdown(n) n 0 > if n . " " . n 1 - countdown then end
+
+:main
+    -5 sign . cr
+    0 sign . cr
+    7 sign . cr
+    95 grade 80 grade 60 grade 10 grade . . . . cr
+    true if "then" . then cr
+    false if "skipped" . then "after" . cr
+    1 2 < if 1 2 > if "no" else "nested" then . else "outer" . then cr
+    5 countdown cr
+end
+PC
+
+expect_output branching "$(printf 'negative\nzero\npositive\nFCBA\nthen\nafter\nnested\n5 4 3 2 1 ')" "$dir/branching.pc" || exit 1
+
+printf ':main true if 1 . end\n' > "$dir/open.pc"
+expect_error "open if" "1:12: 'if' is never closed by 'then' in routine 'main'" "$dir/open.pc" || exit 1
+
+printf ':main true 1 . then end\n' > "$dir/then.pc"
+expect_error "stray then" "1:16: 'then' without matching 'if' in routine 'main'" "$dir/then.pc" || exit 1
+
+printf ':main true if 1 else 2 else 3 then . end\n' > "$dir/else.pc"
+expect_error "second else" "1:24: 'else' without matching 'if' in routine 'main'" "$dir/else.pc" || exit 1
+
+printf ':helper(x) x if 1 else 2 end\n:main true helper . end\n' > "$dir/helper.pc"
+expect_error "open else in a callee" "1:19: 'else' is never closed by 'then' in routine 'helper'" "$dir/helper.pc" || exit 1
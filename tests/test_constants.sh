@@ -0,0 +1,42 @@
+#!/bin/sh
+# globals nobody binds are folded into constants, globals bound by some
+# routine (or by --init) keep being read, binds to a parameter or to a
+# local of the same name don't count
+. tests/lib.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/constants.pc" <<'PC'
+@k 3
+@count 0
+@name "global"
+@n 1
+
+:bump count 1 + count = end
+:param(n) 7 n = n . end
+:local
+    @name "x"
+    "local" name =
+    name .
+end
+:setup 40 count = end
+
+:main
+    k 2 * . cr
+    count . bump bump count . cr
+    2 param n . cr
+    local " " . name . cr
+    k 1 + k * . cr
+end
+PC
+
+expect_output constants "$(printf '6\n02\n71\nlocal global\n12')" "$dir/constants.pc" || exit 1
+expect_output "constants after init" "$(printf '6\n4042\n71\nlocal global\n12')" --init=setup "$dir/constants.pc" || exit 1
+
+# only count is read from its variable, the others became constants
+loads=$(bin/pancake --no-inline "$dir/constants.pc" 2>/dev/null | sed -n '/^>>>>>>> \[ROUTINES\]/,/^=====/p' |
+        awk '$1 == "VAR_LOAD" {print $3}' | sort -u)
+if [ "$loads" != "count" ]; then
+    echo "constants: expected only count loaded from its variable, got '$loads'"
+    exit 1
+fi
@@ -0,0 +1,37 @@
+#!/bin/sh
+# requests against a source with errors fail without leaking the partial
+# program, the resident size of the daemon stays flat
+dir=$(mktemp -d)
+trap 'kill $daemon 2>/dev/null; rm -rf "$dir"' EXIT
+
+printf '@limit 10\n:helper(x) x limit * end\n:main 1 helper nope . end\n' > "$dir/broken.pc"
+
+bin/pancake --serve="$dir/sock" >/dev/null 2>&1 &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$dir/sock" ] && break
+    sleep 0.2
+done
+
+requests() {
+    i=0
+    while [ $i -lt "$1" ]; do
+        reply=$(bin/tests/daemon_client "$dir/sock" "$dir/broken.pc main")
+        [ "$reply" = "error" ] || { echo "broken source: expected error, got '$reply'"; exit 1; }
+        i=$((i+1))
+    done
+}
+
+rss() {
+    awk '/^VmRSS/ {print $2}' "/proc/$daemon/status"
+}
+
+requests 200
+before=$(rss)
+requests 2000
+after=$(rss)
+
+if [ $((after - before)) -gt 1024 ]; then
+    echo "broken source: resident size grew from $before KiB to $after KiB"
+    exit 1
+fi
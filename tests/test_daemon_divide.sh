@@ -0,0 +1,26 @@
+#!/bin/sh
+# a runtime error in a request is reported and the daemon keeps serving
+dir=$(mktemp -d)
+trap 'kill $daemon 2>/dev/null; rm -rf "$dir"' EXIT
+
+printf ':main 1 0 / . end\n' > "$dir/divide.pc"
+printf ':main "alive" . end\n' > "$dir/alive.pc"
+
+bin/pancake --serve="$dir/sock" >/dev/null 2>&1 &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$dir/sock" ] && break
+    sleep 0.2
+done
+
+reply=$(bin/tests/daemon_client "$dir/sock" "$dir/divide.pc main")
+if [ "$(echo "$reply" | head -n 1)" != "error" ]; then
+    echo "division by zero: expected error, got '$reply'"
+    exit 1
+fi
+
+reply=$(bin/tests/daemon_client "$dir/sock" "$dir/alive.pc main")
+if [ "$reply" != "$(printf 'ok\nalive')" ]; then
+    echo "second request: expected ok, got '$reply'"
+    exit 1
+fi
@@ -0,0 +1,35 @@
+#!/bin/sh
+# routines main can't reach are dropped before compiling, so their errors
+# don't matter unless --no-dce keeps them. With --lazy a routine is only
+# compiled by its first call
+. tests/lib.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/dce.pc" <<'PC'
+@unused 0
+:unreachable nope end
+:used "used" . cr end
+:main used end
+PC
+
+expect_output dce "used" "$dir/dce.pc" || exit 1
+expect_error "no dce" "Symbol has not been declared: 'nope'" --no-dce "$dir/dce.pc" || exit 1
+
+# the dump only lists the routines main can reach
+routines=$(bin/pancake "$dir/dce.pc" 2>/dev/null | sed -n '/^>>>>>>> \[ROUTINES\]/,/^=====/p' | awk '$1 == "ID:" {print $2}' | tr '\n' ' ')
+if [ "$routines" != "used main " ]; then
+    echo "dce: expected routines 'used main ', got '$routines'"
+    exit 1
+fi
+
+# later is too long to be inlined, it is reachable but never called
+cat > "$dir/lazy.pc" <<'PC'
+:later(x) x nope x x x x x x x x x . end
+:main
+    true if "ok" . cr else 1 later then
+end
+PC
+
+expect_output lazy "ok" --lazy "$dir/lazy.pc" || exit 1
+expect_error "not lazy" "Symbol has not been declared: 'nope'" "$dir/lazy.pc" || exit 1
@@ -0,0 +1,7 @@
+#!/bin/sh
+# an error in the routine of each-line releases the file or stdin
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf 'a\nb\n' > "$dir/lines.txt"
+printf 'one\ntwo\nthree\n' | bin/tests/input_host "$dir/lines.txt" 2>/dev/null
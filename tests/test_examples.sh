@@ -0,0 +1,15 @@
+#!/bin/sh
+# every example prints what tests/examples/NAME.out holds, with inlining on
+# and off. Examples reading stdin get two lines
+. tests/lib.sh
+
+for expected in tests/examples/*.out; do
+    name=$(basename "$expected" .out)
+    for inline in --inline-threshold=8 --no-inline; do
+        out=$(printf 'one\ntwo\n' | bin/pancake "$inline" "examples/$name.pc" 2>/dev/null | strip_dump)
+        if [ "$out" != "$(cat "$expected")" ]; then
+            printf '%s (%s): expected\n%s\ngot\n%s\n' "$name" "$inline" "$(cat "$expected")" "$out"
+            exit 1
+        fi
+    done
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# arrays, tables and tasks are equal to themselves, not to others of the
+# same type even with the same contents
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/identity.pc" <<'PC'
+:one 1 end
+:main
+    table dup == .
+    table table == .
+    table dup != .
+    3 range dup == .
+    3 range 3 range == .
+    0 spawn one dup == . join drop
+    cr
+end
+PC
+
+out=$(bin/pancake "$dir/identity.pc" 2>&1 | tail -n 1)
+if [ "$out" != "truefalsefalsetruefalsetrue" ]; then
+    echo "identity: expected 'truefalsefalsetruefalsetrue', got '$out'"
+    exit 1
+fi
@@ -0,0 +1,19 @@
+#!/bin/sh
+# two variables holding the same table still share it once the image is
+# loaded
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/alias.pc" <<'PC'
+@t 0
+@u 0
+:setup table t = t u = t "inner" table insert drop end
+:main u "key" 1 insert drop t "key" contains . cr u len . cr end
+PC
+
+bin/pancake --init=setup --save-image="$dir/alias.img" "$dir/alias.pc" >/dev/null 2>&1 || exit 1
+out=$(bin/pancake --load-image="$dir/alias.img" 2>&1 | tail -n 2)
+if [ "$out" != "$(printf 'true\n2')" ]; then
+    echo "aliased table: expected 'true 2', got '$out'"
+    exit 1
+fi
@@ -0,0 +1,3 @@
+#!/bin/sh
+# parallel lexing matches serial lexing at chunk seams
+bin/tests/lex_parallel
@@ -0,0 +1,3 @@
+#!/bin/sh
+# a host linked with libpancake survives bad sources and runtime errors
+bin/tests/library_host 2>/dev/null
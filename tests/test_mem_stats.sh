@@ -0,0 +1,15 @@
+#!/bin/sh
+# the line buffer of stdin and the task scheduler are accounted and released
+out=$(printf 'a\nbb\nccc\n' | bin/pancake --mem-stats examples/lines.pc 2>&1 | grep '^values\|^total')
+bytes=$(echo "$out" | awk '/^values/ {print $4}')
+leaked=$(echo "$out" | awk '/^total/ {print $6 " " $7}')
+if [ "$bytes" -lt 1048576 ] || [ "$leaked" != "0 0" ]; then
+    echo "lines: expected the line buffer accounted and no leaks, got '$out'"
+    exit 1
+fi
+
+leaked=$(bin/pancake --mem-stats examples/tasks.pc 2>&1 | awk '/^total/ {print $6 " " $7}')
+if [ "$leaked" != "0 0" ]; then
+    echo "tasks: expected no leaks, got '$leaked'"
+    exit 1
+fi
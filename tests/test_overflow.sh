@@ -0,0 +1,32 @@
+#!/bin/sh
+# ints that would overflow become float instead of wrapping or trapping,
+# whether computed at run time, folded or in a batch
+. tests/lib.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/overflow.pc" <<'PC'
+:min 0 9223372036854775807 - 1 - end
+:main
+    min -1 / . cr
+    min -1 % . cr
+    9223372036854775807 1 + . cr
+    min 1 - . cr
+    4611686018427387904 2 * . cr
+    0 9223372036854775807 - 1 - -1 / . cr
+    3 4 * .
+end
+PC
+expect_output overflow "$(printf '9223372036854776000.0\n0\n9223372036854776000.0\n-9223372036854776000.0\n9223372036854776000.0\n9223372036854776000.0\n12')" "$dir/overflow.pc" || exit 1
+
+printf ':op(a b) a b / a b %% a b + a b * end\n:main end\n' > "$dir/batch.pc"
+printf -- '-9223372036854775808 -1\n-9223372036854775808 -1\n9223372036854775807 1\n6 3\n' > "$dir/batch.in"
+out=$(bin/pancake --batch=op "$dir/batch.pc" < "$dir/batch.in" 2>/dev/null | strip_dump)
+expected='[9223372036854776000.0, 0, -9223372036854776000.0, 9223372036854776000.0 <-
+[9223372036854776000.0, 0, -9223372036854776000.0, 9223372036854776000.0 <-
+[9223372036854775807, 0, 9223372036854776000.0, 9223372036854775807 <-
+[2, 0, 9, 18 <-'
+if [ "$out" != "$expected" ]; then
+    printf 'batch: expected\n%s\ngot\n%s\n' "$expected" "$out"
+    exit 1
+fi
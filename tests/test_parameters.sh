@@ -0,0 +1,60 @@
+#!/bin/sh
+# parameters and locals live in the frame of each call, recursion gets its
+# own, and a parameter hides a global of the same name
+. tests/lib.sh
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/parameters.pc" <<'PC'
+@n 100
+@total 0
+
+:add(a, b) a b + end
+:swap2(a, b) b a end
+
+:shadow(n) n 1 + end
+
+:fact(n)
+    @acc 1
+    n 1 > if n n 1 - fact * acc = then
+    acc
+end
+
+:sum(a, b, c)
+    @s 0
+    a b + s =
+    s c + s =
+    s
+end
+
+:keep(x)
+    @first 0
+    @second 0
+    x first =
+    first 2 * second =
+    first . " " . second .
+end
+
+:main
+    3 4 add . cr
+    1 2 swap2 . " " . . cr
+    5 shadow . " " . n . cr
+    10 fact . cr
+    1 2 3 sum . cr
+    7 keep cr
+    2 keep cr
+    1.5 2 add . cr
+    "a" "b" swap2 . . cr
+end
+PC
+
+expect_output parameters "$(printf '7\n1 2\n6 100\n3628800\n6\n7 14\n2 4\n3.5\nab')" "$dir/parameters.pc" || exit 1
+
+printf ':f(a, a) a end\n:main 1 1 f . end\n' > "$dir/twice.pc"
+expect_error "repeated parameter" "1:7: invalid parameter 'a' in routine 'f'" "$dir/twice.pc" || exit 1
+
+printf ':main(x) x . end\n' > "$dir/main.pc"
+expect_error "parameters of main" "1:2: entry point 'main' can't take parameters" "$dir/main.pc" || exit 1
+
+printf ':f(a, b) a b + end\n:main 1 f . end\n' > "$dir/missing.pc"
+expect_error "missing argument" "Routine 'f' expects 2 arguments, found 1 on the stack" "$dir/missing.pc" || exit 1
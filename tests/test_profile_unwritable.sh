@@ -0,0 +1,20 @@
+#!/bin/sh
+# a profile that can't be written is reported once, from main or at exit
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf ':main 1 . end\n' > "$dir/ok.pc"
+printf ':main 1 0 / . end\n' > "$dir/divide.pc"
+
+for program in ok divide; do
+    err=$(bin/pancake --profile="$dir/missing/out.prof" "$dir/$program.pc" 2>&1 >/dev/null)
+    status=$?
+    if [ $status -ne 1 ]; then
+        echo "$program: expected status 1, got $status"
+        exit 1
+    fi
+    if [ "$(echo "$err" | grep -c 'Could not open file')" -ne 1 ]; then
+        printf '%s: expected one open error, got\n%s\n' "$program" "$err"
+        exit 1
+    fi
+done
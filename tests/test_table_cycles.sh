@@ -0,0 +1,26 @@
+#!/bin/sh
+# a table inside itself, directly or through another one, is printed with a
+# marker where it repeats, and can be saved in an image
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/cycles.pc" <<'PC'
+@a 0
+@b 0
+:setup table a = table b = a "b" b insert drop b "a" a insert drop end
+:main table dup "self" over insert drop . cr a . cr end
+PC
+
+expected=$(printf '[self: [...]]\n[b: [a: [...]]]')
+out=$(bin/pancake --init=setup "$dir/cycles.pc" 2>&1 | tail -n 2)
+if [ "$out" != "$expected" ]; then
+    echo "cycles: expected '$expected', got '$out'"
+    exit 1
+fi
+
+bin/pancake --init=setup --save-image="$dir/cycles.img" "$dir/cycles.pc" >/dev/null 2>&1 || exit 1
+out=$(bin/pancake --load-image="$dir/cycles.img" 2>&1 | tail -n 2)
+if [ "$out" != "$expected" ]; then
+    echo "cycles from an image: expected '$expected', got '$out'"
+    exit 1
+fi
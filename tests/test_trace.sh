@@ -0,0 +1,14 @@
+#!/bin/sh
+# the trace and its replay point to the source tokens, as row:col
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+printf ':add(a, b) a b + end\n:main\n    1 2 add .\n    cr\nend\n' > "$dir/trace.pc"
+
+bin/pancake --trace-file="$dir/trace.bin" "$dir/trace.pc" >/dev/null 2>&1 || exit 1
+out=$(bin/pancake --trace-replay="$dir/trace.bin" 2>&1 | grep 'OP_SUM\|OP_PRINT')
+expected=$(printf '    add:1:16 OP_SUM depth=2 top=VT_INT\n    main:3:13 OP_PRINT depth=1 top=VT_INT')
+if [ "$out" != "$expected" ]; then
+    echo "replay: expected '$expected', got '$out'"
+    exit 1
+fi